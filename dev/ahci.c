@@ -7,6 +7,7 @@
 #include <kernel/proc.h>
 
 #include <dev/ahci.h>
+#include <dev/apic.h>
 #include <dev/pci.h>
 
 static int ahci_block_read(struct block_device *dev, void *buf, size_t offset, size_t sector_count);
@@ -25,9 +26,30 @@ static struct sata_device sata_devices[32] = { 0 };
 static paddr_t ahci_pbase = 0;
 static uintptr_t ahci_vbase = 0;
 
+/* completion interrupts are delivered, otherwise the ports are polled */
+static bool ahci_irq_enabled = false;
+
 static void ahci_irq_handler()
 {
-	kprintf(LOG_ERROR "AHCI INTERRUPT\n");
+	for (int i = 0; i < sata_device_count; i++) {
+		struct sata_device *sdev = &sata_devices[i];
+		hbaport_t *port = &sdev->abar->ports[sdev->port];
+
+		uint32_t is = port->is;
+		if (is == 0)
+			continue;
+
+		/* acknowledge, the bits are cleared by writing ones */
+		port->is = is;
+
+		if (is & HBA_PORT_IS_TFES)
+			sdev->error = true;
+
+		waitq_wake_all(&sdev->wq);
+	}
+
+	abar->is = abar->is;
+	lapic_eoi();
 }
 
 static int ahci_port_type(hbaport_t *port)
@@ -117,7 +139,8 @@ static void ahci_probe_ports(struct pci_device *dev, hbamem_t *abar)
 
 				struct block_device *bdev;
 				bdev = block_register(name, &ahci_block_ops, sdev, sector_count, sdev->sector_size);
-				block_gpt_init(bdev);
+				if (bdev)
+					block_gpt_init(bdev);
 
 				ahci_rebase(&abar->ports[i], i);
 				sata_device_count++;
@@ -204,25 +227,21 @@ bool ahci_access_sectors(struct sata_device *dev, paddr_t lba, uint16_t count, p
 	}
 
 	/* issue command */
+	dev->error = false;
 	port->ci = 1 << slot;
 
 	/* wait for completion */
-	struct proc *proc = proc_find(getpid());
-	while (1) {
-		if (port->is & HBA_PORT_IS_TFES) {
-			kprintf(LOG_ERROR "AHCI: Read disk error\n");
-			return false;
+	if (ahci_irq_enabled) {
+		wait_event(&dev->wq, (port->ci & (1 << slot)) == 0 || dev->error || (port->is & HBA_PORT_IS_TFES));
+	} else {
+		struct proc *proc = proc_current();
+		while ((port->ci & (1 << slot)) && !(port->is & HBA_PORT_IS_TFES)) {
+			if (proc->in_kernel)
+				sswtch();
 		}
-
-		if ((port->ci & (1 << slot)) == 0)
-			break;
-		else if (proc->buddy_proc)
-			sswtch();
-
 	}
 
-	/* check again */
-	if (port->is & HBA_PORT_IS_TFES) {
+	if (dev->error || (port->is & HBA_PORT_IS_TFES)) {
 		kprintf(LOG_ERROR "AHCI: Read disk error\n");
 		return false;
 	}
@@ -307,13 +326,21 @@ void ahci_init()
 		return;
 	}
 
-	/* setup device irq number */
-	uint16_t irq = irq_highest_free();
-	uint32_t tmp = pci_config_read_long(dev->bus, dev->slot, dev->func, 0x3C);
-	tmp &= 0xFFFFFF00;
-	tmp |= irq;
-	pci_config_write_long(dev->bus, dev->slot, dev->func, 0x3C, tmp);
-	irq_map(irq, ahci_irq_handler);
+	/* completion interrupts come in as MSI on the BSP */
+	int irq = irq_highest_free();
+	if (irq >= 0 && pci_enable_msi(dev, 0x20 + irq, lapic_idno()) == 0) {
+		irq_map(irq, ahci_irq_handler);
+
+		for (int i = 0; i < sata_device_count; i++) {
+			struct sata_device *sdev = &sata_devices[i];
+			waitq_init(&sdev->wq);
+			abar->ports[sdev->port].ie = HBA_PORT_IE_DHRE | HBA_PORT_IE_TFEE;
+		}
+
+		ahci_irq_enabled = true;
+	} else {
+		kprintf(LOG_WARN "AHCI: no MSI support, polling for completion\n");
+	}
 
 	kprintf(LOG_SUCCESS "AHCI controller ready\n");
 }
@@ -1,7 +1,10 @@
 #include <kernel/acpi.h>
 #include <kernel/mem.h>
 #include <kernel/msr.h>
+#include <kernel/cpufeature.h>
+#include <kernel/clock.h>
 #include <dev/apic.h>
+#include <dev/pit.h>
 
 #include <stdint.h>
 
@@ -9,6 +12,10 @@ static uintptr_t ioapic_addr = 0xFEC00000;
 static uintptr_t lapic_addr = 0;
 static uint8_t lapic_id = 0;
 
+/* measured at boot, the timer runs at the same rate on every CPU */
+static uint64_t lapic_timer_hz = 0;
+static bool lapic_tsc_deadline = false;
+
 static struct ioapic {
 	uint32_t reg;
 	uint32_t pad[3];
@@ -90,6 +97,44 @@ uint8_t lapic_idno()
 	return lapic_read(lapic_addr, LAPIC_ID) >> 24;
 }
 
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector)
+{
+	/* wait for the previous IPI to be accepted */
+	while (lapic_read(lapic_addr, LAPIC_ICR) & LAPIC_ICR_PENDING)
+		(void)0;
+
+	lapic_write(lapic_addr, LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+	lapic_write(lapic_addr, LAPIC_ICR, LAPIC_ICR_ASSERT | vector);
+}
+
+/* Measure the LAPIC timer and the TSC against 10ms of PIT channel 2 */
+static void apic_timer_calibrate()
+{
+	lapic_write(lapic_addr, LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+	lapic_write(lapic_addr, LAPIC_TIMER, LAPIC_TIMER_MASKED);
+
+	pit_oneshot(PIT_HZ / 100);
+
+	lapic_write(lapic_addr, LAPIC_TIMER_INIT_COUNT, 0xFFFFFFFF);
+	uint64_t tsc = rdtsc();
+
+	while (!pit_expired())
+		(void)0;
+
+	uint32_t ticks = 0xFFFFFFFF - lapic_read(lapic_addr, LAPIC_CUR_COUNT);
+	tsc = rdtsc() - tsc;
+
+	lapic_write(lapic_addr, LAPIC_TIMER_INIT_COUNT, 0);
+
+	lapic_timer_hz = (uint64_t)ticks * 100;
+	clock_init(tsc * 100);
+
+	lapic_tsc_deadline = boot_cpu_has(CPU_FEATURE_TSC_DEADLINE);
+
+	kprintf(LOG_SUCCESS "APIC timer running at %d kHz%s\n", (int)(lapic_timer_hz / 1000),
+		lapic_tsc_deadline ? ", using TSC-deadline mode" : "");
+}
+
 void apic_init()
 {
 	if (__madt == NULL) {
@@ -125,20 +170,49 @@ void apic_init()
 
 	lapic_eoi();
 
+	apic_timer_calibrate();
+
 	kprintf(LOG_SUCCESS "APIC initialized\n");
 }
 
+/* Set up the timer of this CPU for apic_timer_oneshot
+ *
+ * The timer does not tick on its own, the scheduler arms it for the end of
+ * each timeslice and leaves it stopped while the CPU is idle.
+ */
 void apic_enable_timer()
 {
 	/* set TPR to ensure interrupts are accepted */
 	lapic_write(lapic_addr, LAPIC_TPR, 0);
 
-	/* set timer divisor */
-	lapic_write(lapic_addr, LAPIC_TIMER_DIV, 0x3);
+	if (lapic_tsc_deadline) {
+		lapic_write(lapic_addr, LAPIC_TIMER, LAPIC_TIMER_VECTOR | LAPIC_TIMER_TSC_DEADLINE);
+	} else {
+		lapic_write(lapic_addr, LAPIC_TIMER_DIV, LAPIC_TIMER_DIV_16);
+		lapic_write(lapic_addr, LAPIC_TIMER, LAPIC_TIMER_VECTOR);
+	}
 
-	/* set timer initial count */
-	lapic_write(lapic_addr, LAPIC_TIMER_INIT_COUNT, 0xFFF);
+	apic_timer_stop();
+}
 
-	/* set timer vector and enable */
-	lapic_write(lapic_addr, LAPIC_TIMER, 0x20 | 0x20000);
+/* raise the timer interrupt on this CPU ns nanoseconds from now */
+void apic_timer_oneshot(uint64_t ns)
+{
+	if (lapic_tsc_deadline) {
+		wrmsr(MSR_IA32_TSC_DEADLINE, rdtsc() + clock_ns_to_cycles(ns));
+		return;
+	}
+
+	uint64_t count = ns * lapic_timer_hz / NSEC_PER_SEC;
+	count = MIN(MAX(count, 1ull), 0xFFFFFFFFull);
+
+	lapic_write(lapic_addr, LAPIC_TIMER_INIT_COUNT, count);
+}
+
+void apic_timer_stop()
+{
+	if (lapic_tsc_deadline)
+		wrmsr(MSR_IA32_TSC_DEADLINE, 0);
+	else
+		lapic_write(lapic_addr, LAPIC_TIMER_INIT_COUNT, 0);
 }
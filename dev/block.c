@@ -3,11 +3,16 @@
 #include <kernel/block.h>
 #include <kernel/slab.h>
 #include <kernel/gpt.h>
+#include <kernel/trace.h>
 
 #define MAX_BLOCK_DEVICES 24
 
+/* Devices are only ever appended. The slot is filled before the count is
+ * published, so readers that load the count first need no lock.
+ */
 struct block_device *block_devices[MAX_BLOCK_DEVICES];
 size_t block_devices_count = 0;
+static spinlock_t block_devices_lock = 0;
 
 struct block_device *block_register(char *name, struct block_device_ops *ops, void *data, size_t block_count, size_t block_size)
 {
@@ -25,8 +30,16 @@ struct block_device *block_register(char *name, struct block_device_ops *ops, vo
 	bdev->fs = NULL;
 	memcpy(&bdev->ops, ops, sizeof(struct block_device_ops));
 
+	spinlock_acquire(&block_devices_lock);
+	if (block_devices_count == MAX_BLOCK_DEVICES) {
+		spinlock_release(&block_devices_lock);
+		kfree(bdev);
+		return NULL;
+	}
+
 	block_devices[block_devices_count] = bdev;
-	block_devices_count++;
+	__atomic_store_n(&block_devices_count, block_devices_count + 1, __ATOMIC_RELEASE);
+	spinlock_release(&block_devices_lock);
 
 #ifdef KDEBUG
 	kprintf(LOG_DEBUG "Registered block device %s\n", name);
@@ -37,13 +50,15 @@ struct block_device *block_register(char *name, struct block_device_ops *ops, vo
 
 struct block_device **block_get_all_devices(int *n)
 {
-	*n = block_devices_count;
+	*n = __atomic_load_n(&block_devices_count, __ATOMIC_ACQUIRE);
 	return block_devices;
 }
 
 struct block_device *block_get_device(const char *name)
 {
-	for (size_t i = 0; i < block_devices_count; i++) {
+	size_t count = __atomic_load_n(&block_devices_count, __ATOMIC_ACQUIRE);
+
+	for (size_t i = 0; i < count; i++) {
 		if (!strcmp(block_devices[i]->name, name))
 			return block_devices[i];
 	}
@@ -53,12 +68,20 @@ struct block_device *block_get_device(const char *name)
 
 inline int block_read(struct block_device *bdev, void *buf, size_t offset, size_t size)
 {
-	return bdev->ops.read(bdev, buf, offset + bdev->lba_start, size);
+	trace(TRACE_BLOCK_READ, offset + bdev->lba_start, size);
+	int ret = bdev->ops.read(bdev, buf, offset + bdev->lba_start, size);
+	trace(TRACE_BLOCK_DONE, ret, size);
+
+	return ret;
 }
 
 inline int block_write(struct block_device *bdev, void *buf, size_t offset, size_t size)
 {
-	return bdev->ops.write(bdev, buf, offset + bdev->lba_start, size);
+	trace(TRACE_BLOCK_WRITE, offset + bdev->lba_start, size);
+	int ret = bdev->ops.write(bdev, buf, offset + bdev->lba_start, size);
+	trace(TRACE_BLOCK_DONE, ret, size);
+
+	return ret;
 }
 
 void kerror_print_blkdevs()
@@ -21,7 +21,7 @@ uint32_t pci_config_read_long(uint8_t bus, uint8_t slot, uint8_t func, uint8_t o
 	return inl(PCIPM_CONFIG_DATA);
 }
 
-void pci_config_write_long(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t data)
+void pci_config_write_long(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t data)
 {
 	uint32_t addr;
 	uint32_t lbus = bus;
@@ -97,6 +97,60 @@ struct pci_device *pci_find_device(uint8_t class, uint8_t subclass)
 	return NULL;
 }
 
+/* offset of the capability with the given id in the configuration space, 0 if
+ * the device doesn't have it
+ */
+static uint8_t pci_find_capability(struct pci_device *dev, uint8_t id)
+{
+	uint32_t status = pci_config_read_long(dev->bus, dev->slot, dev->func, 0x04) >> 16;
+	if (!(status & PCI_STATUS_CAP_LIST))
+		return 0;
+
+	uint8_t offset = pci_config_read_long(dev->bus, dev->slot, dev->func, 0x34) & 0xFC;
+
+	while (offset) {
+		uint32_t cap = pci_config_read_long(dev->bus, dev->slot, dev->func, offset);
+		if ((cap & 0xFF) == id)
+			return offset;
+
+		offset = (cap >> 8) & 0xFC;
+	}
+
+	return 0;
+}
+
+/* Deliver the interrupts of dev as messages with the given vector to a LAPIC,
+ * which needs no IOAPIC routing. Legacy INTx is disabled on success.
+ */
+int pci_enable_msi(struct pci_device *dev, uint8_t vector, uint8_t apic_id)
+{
+	uint8_t cap = pci_find_capability(dev, PCI_CAP_MSI);
+	if (cap == 0)
+		return -ENODEV;
+
+	uint32_t ctl = pci_config_read_long(dev->bus, dev->slot, dev->func, cap);
+
+	pci_config_write_long(dev->bus, dev->slot, dev->func, cap + 4, PCI_MSI_ADDRESS | ((uint32_t)apic_id << 12));
+
+	if ((ctl >> 16) & PCI_MSI_64BIT) {
+		pci_config_write_long(dev->bus, dev->slot, dev->func, cap + 8, 0);
+		pci_config_write_long(dev->bus, dev->slot, dev->func, cap + 12, vector);
+	} else {
+		pci_config_write_long(dev->bus, dev->slot, dev->func, cap + 8, vector);
+	}
+
+	/* single message, enabled */
+	ctl &= ~(PCI_MSI_MME_MASK << 16);
+	ctl |= PCI_MSI_ENABLE << 16;
+	pci_config_write_long(dev->bus, dev->slot, dev->func, cap, ctl);
+
+	/* keep the status half zero, its bits are cleared by writing ones */
+	uint32_t cmd = pci_config_read_long(dev->bus, dev->slot, dev->func, 0x04) & 0xFFFF;
+	pci_config_write_long(dev->bus, dev->slot, dev->func, 0x04, cmd | PCI_CMD_INTX_DISABLE);
+
+	return 0;
+}
+
 void pci_init()
 {
 	pci_devices = kzalloc(sizeof(struct pci_device) * MAX_PCI_DEVICES, ALLOC_KERN);
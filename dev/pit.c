@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <kernel/common.h>
+#include <kernel/pio.h>
+#include <dev/pit.h>
+
+/* Only channel 2 is used, as a reference to calibrate the other timers
+ * against. Its gate and output are wired to port 0x61, so it can be polled
+ * without taking an interrupt.
+ */
+
+void pit_oneshot(uint16_t count)
+{
+	/* gate low and speaker off while programming */
+	uint8_t gate = inb(PIT_CH2_GATE) & ~0x03;
+	outb(PIT_CH2_GATE, gate);
+
+	/* channel 2, lobyte/hibyte, mode 0: output goes high at terminal count */
+	outb(PIT_CMD, 0xB0);
+	outb(PIT_CH2_DATA, count & 0xFF);
+	outb(PIT_CH2_DATA, count >> 8);
+
+	/* counting starts on the rising edge of the gate */
+	outb(PIT_CH2_GATE, gate | 0x01);
+}
+
+bool pit_expired()
+{
+	return inb(PIT_CH2_GATE) & 0x20;
+}
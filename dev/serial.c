@@ -8,11 +8,24 @@
 #include <kernel/syscall.h>
 #include <kernel/char.h>
 #include <kernel/ringbuf.h>
+#include <kernel/atomic.h>
+#include <kernel/lock.h>
 
 #include <dev/serial.h>
 #include <dev/apic.h>
 
 struct char_device *tty0;
+
+/* Output goes through serial_tx once serial_init has run, and the THR empty
+ * interrupt moves it to the UART a FIFO at a time. serial_tx_active is set
+ * while that interrupt is enabled. Before serial_init and after serial_sync
+ * every byte is written by polling.
+ */
+static ringbuf_t *serial_tx = NULL;
+static spinlock_t serial_tx_lock = 0;
+static uint64_t serial_tx_active = 0;
+static volatile bool serial_polled = true;
+
 ssize_t serial_write_dev(void *dev, void *buf, size_t offset, size_t count);
 ssize_t serial_read_dev(void *dev, void *buf, size_t offset, size_t count);
 
@@ -38,11 +51,16 @@ int serial_init()
 		return 1;
 	}
 
-	outb(COM1 | 1, 0x01); /* Enable interrupts */
+	outb(COM1 | UART_IER, UART_IER_RX); /* Enable interrupts */
 	outb(COM1 | 4, 0x0F); /* Enter normal operation */
+
+	serial_tx = ringbuf_create(SERIAL_TX_SIZE, RINGBUF_MP);
+	if (serial_tx)
+		serial_polled = false;
+
 	kprintf(LOG_SUCCESS "Serial COM1 initialized\n");
 
-	tty0 = char_device_create("tty0", ringbuf_create(1024));
+	tty0 = char_device_create("tty0", ringbuf_create(1024, RINGBUF_MP));
 	serial_dev_ops.dev = tty0;
 
 	devfs_insert(NULL, "tty0", VFS_VNO_CHARDEV, &serial_dev_ops);
@@ -51,18 +69,120 @@ int serial_init()
 	return 0;
 }
 
-inline void serial_putchar(char c)
+static inline void serial_putchar_polled(char c)
 {
 	/* Wait for line to be clear */
-	while ((inb(COM1 | 5) & 0x20) == 0)
+	while ((inb(COM1 | UART_LSR) & UART_LSR_THRE) == 0)
 		;
 
 	outb(COM1, c);
 }
 
+/* Move up to a FIFO worth of serial_tx to the UART if it can take it, called
+ * with serial_tx_lock held. Returns false once serial_tx is empty.
+ */
+static bool serial_tx_burst()
+{
+	char buf[UART_FIFO_SIZE];
+
+	if ((inb(COM1 | UART_LSR) & UART_LSR_THRE) == 0)
+		return true;
+
+	size_t n = ringbuf_read(serial_tx, buf, sizeof(buf));
+	for (size_t i = 0; i < n; i++)
+		outb(COM1, buf[i]);
+
+	return n != 0;
+}
+
+/* the THR empty interrupt drains serial_tx from now on */
+static void serial_tx_kick()
+{
+	if (test_and_set_bit(0, &serial_tx_active))
+		return;
+
+	uint64_t flags = spinlock_acquire_irqsave(&serial_tx_lock);
+	outb(COM1 | UART_IER, UART_IER_RX | UART_IER_THRE);
+	spinlock_release_irqrestore(&serial_tx_lock, flags);
+}
+
+/* THR empty, already acknowledged by reading IIR */
+static void serial_tx_drain()
+{
+	spinlock_acquire(&serial_tx_lock);
+
+	if (!serial_tx_burst()) {
+		outb(COM1 | UART_IER, UART_IER_RX);
+		clear_bit(0, &serial_tx_active);
+		smp_mb();
+
+		/* a writer may have seen the interrupt still enabled */
+		if (ringbuf_used(serial_tx)) {
+			set_bit(0, &serial_tx_active);
+			outb(COM1 | UART_IER, UART_IER_RX | UART_IER_THRE);
+		}
+	}
+
+	spinlock_release(&serial_tx_lock);
+}
+
+/* serial_tx is full, make room without waiting for the interrupt */
+static void serial_tx_poll()
+{
+	uint64_t flags = spinlock_acquire_irqsave(&serial_tx_lock);
+	while ((inb(COM1 | UART_LSR) & UART_LSR_THRE) == 0)
+		cpu_relax();
+	serial_tx_burst();
+	spinlock_release_irqrestore(&serial_tx_lock, flags);
+}
+
+ssize_t serial_write(const char *buf, size_t count)
+{
+	if (serial_polled) {
+		for (size_t i = 0; i < count; i++)
+			serial_putchar_polled(buf[i]);
+		return count;
+	}
+
+	size_t written = 0;
+	while (written < count) {
+		size_t n = ringbuf_write(serial_tx, buf + written, count - written);
+		if (n == 0)
+			serial_tx_poll();
+		written += n;
+	}
+
+	serial_tx_kick();
+	return count;
+}
+
+void serial_putchar(char c)
+{
+	serial_write(&c, 1);
+}
+
+/* Write out what is still buffered and poll for all further output, so that
+ * a panic is printed even with interrupts off or the kernel in a bad state
+ */
+void serial_sync()
+{
+	if (serial_polled)
+		return;
+
+	serial_polled = true;
+
+	/* whoever holds the lock may never release it */
+	for (int i = 0; i < 1000 && !spinlock_try_acquire(&serial_tx_lock); i++)
+		cpu_relax();
+
+	char c;
+	while (ringbuf_read(serial_tx, &c, 1))
+		serial_putchar_polled(c);
+}
+
 void serial_read_line()
 {
-	if ((inb(COM1 | 5) & 0x01) == 0)
+	if ((inb(COM1 | UART_LSR) & UART_LSR_DR) == 0)
 		return;
 
 	char c = inb(COM1);
@@ -70,9 +190,32 @@ void serial_read_line()
 	ringbuf_write(tty0->data, &c, 1);
 }
 
+/* The line is edge triggered and only fires again once no cause is left
+ * pending, so handle them all before returning.
+ */
 void serial_trap()
 {
-	serial_read_line();
+	uint8_t iir;
+
+	while (!((iir = inb(COM1 | UART_IIR)) & UART_IIR_NONE)) {
+		switch (iir & UART_IIR_ID) {
+		case UART_IIR_RX:
+		case UART_IIR_TIMEOUT:
+			serial_read_line();
+			break;
+		case UART_IIR_THRE:
+			if (!serial_polled)
+				serial_tx_drain();
+			break;
+		case UART_IIR_LSR:
+			inb(COM1 | UART_LSR);
+			break;
+		case UART_IIR_MSR:
+			inb(COM1 | UART_MSR);
+			break;
+		}
+	}
+
 	lapic_eoi();
 }
 
@@ -84,24 +227,15 @@ ssize_t serial_read(char *buf)
 
 	serial_read_line();
 
-	struct proc *proc = proc_find(getpid());
+	struct proc *proc = proc_current();
 
-	while ((ret = ringbuf_read(tty0->data, &c, 1)) == 0) {
-		sswtch();
-	}
+	ret = ringbuf_read_wait(tty0->data, &c, 1);
 
 	copy_to_user(proc, buf, &c, 1);
 
 	return ret;
 }
 
-ssize_t serial_write(const char *buf, size_t count)
-{
-	for (size_t i = 0; i < count; i++)
-		serial_putchar(buf[i]);
-	return count;
-}
-
 ssize_t serial_write_dev(void *dev, void *buf, size_t offset, size_t count)
 {
 	return serial_write(buf, count);
@@ -2,6 +2,8 @@
 #include <kernel/common.h>
 #include <kernel/slab.h>
 #include <kernel/block.h>
+#include <kernel/kmsg.h>
+#include <kernel/trace.h>
 #include <fs/vfs.h>
 #include <fs/devfs.h>
 
@@ -62,22 +64,18 @@ int devfs_insert(struct vnode *dir, const char *name, uint32_t flags, struct dev
 	dev_vnode->no_free = true;
 	dev_vnode->priv_data = ops;
 
-	spinlock_acquire(&dir->lock);
-
-	dir->num_dirents++;
-	dir->dirents = krealloc(dir->dirents, dir->num_dirents * sizeof(struct dirent), ALLOC_KERN);
-
-	struct dirent *dirent = &dir->dirents[dir->num_dirents - 1];
-
-	memcpy(dirent->name, name, MIN(sizeof(dirent->name) - 1, strlen(name) + 1));
-	dirent->name[MIN(sizeof(dirent->name) - 1, strlen(name))] = '\0';
-	dirent->vnode = dev_vnode;
-	dirent->reclen = sizeof(struct dirent);
-	dirent->inode = 0;
+	struct dirent dirent;
+	memcpy(dirent.name, name, MIN(sizeof(dirent.name) - 1, strlen(name) + 1));
+	dirent.name[MIN(sizeof(dirent.name) - 1, strlen(name))] = '\0';
+	dirent.vnode = dev_vnode;
+	dirent.reclen = sizeof(struct dirent);
+	dirent.inode = 0;
 
+	spinlock_acquire(&dir->lock);
+	int ret = vfs_dirent_append(dir, &dirent);
 	spinlock_release(&dir->lock);
 
-	return 0;
+	return ret;
 }
 
 struct fs *devfs_init()
@@ -101,6 +99,10 @@ struct fs *devfs_init()
 		goto out;
 	}
 
+	devfs_insert(devfs->root, "slabinfo", VFS_VNO_CHARDEV, &slabinfo_dev_info);
+	devfs_insert(devfs->root, "kmsg", VFS_VNO_CHARDEV, &kmsg_dev_info);
+	devfs_insert(devfs->root, "trace", VFS_VNO_CHARDEV, &trace_dev_info);
+
 	/* get all block devices */
 	struct block_device **block_get_all_devices(int *n);
 
@@ -0,0 +1,297 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <kernel/common.h>
+#include <kernel/lock.h>
+#include <kernel/mem.h>
+#include <kernel/slab.h>
+#include <kernel/wait.h>
+
+#include <fs/vfs.h>
+#include <fs/pipe.h>
+
+/* Readers and writers block on the wait queues of the pipe. Copies of less
+ * than a page are done under the lock. Whole pages are filled by the writer
+ * before they are linked into the ring, and unlinked by a reader that takes all
+ * of them before it copies them out, so the lock isn't held for those copies.
+ */
+
+static struct kmem_cache *pipe_cache;
+
+#define PIPE_RD(_flags) ((_flags) & (O_RDONLY | O_RDWR))
+#define PIPE_WR(_flags) ((_flags) & (O_WRONLY | O_RDWR))
+
+static inline uint32_t pipe_load(uint32_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline struct pipe_buf *pipe_buf_at(struct pipe *pipe, uint32_t i)
+{
+	return &pipe->bufs[i & (PIPE_BUFS - 1)];
+}
+
+/* called with the lock held */
+static void pipe_page_put(struct pipe *pipe, char *page)
+{
+	if (pipe->spare == NULL)
+		pipe->spare = page;
+	else
+		buddy_free(page);
+}
+
+/* bytes left in the last page, called with the lock held */
+static size_t pipe_room(struct pipe *pipe)
+{
+	if (pipe->head == pipe->tail)
+		return 0;
+
+	struct pipe_buf *last = pipe_buf_at(pipe, pipe->head - 1);
+	return PIPE_PAGE_SIZE - (last->off + last->len);
+}
+
+/* bytes that can be written without waiting, called with the lock held */
+static size_t pipe_space(struct pipe *pipe)
+{
+	return (PIPE_BUFS - (pipe->head - pipe->tail)) * PIPE_PAGE_SIZE + pipe_room(pipe);
+}
+
+/* a free slot for a whole page */
+static bool pipe_has_slot(struct pipe *pipe)
+{
+	return pipe_load(&pipe->head) - pipe_load(&pipe->tail) < PIPE_BUFS || pipe_load(&pipe->readers) == 0;
+}
+
+static bool pipe_readable(struct pipe *pipe)
+{
+	return pipe_load(&pipe->head) != pipe_load(&pipe->tail) || pipe_load(&pipe->writers) == 0;
+}
+
+/* an approximation without the lock, rechecked once it is taken */
+static bool pipe_writable(struct pipe *pipe, size_t need)
+{
+	return pipe_space(pipe) >= need || pipe_load(&pipe->readers) == 0;
+}
+
+void pipe_init()
+{
+	pipe_cache = kmem_cache_create("pipe", sizeof(struct pipe), 0, 0, NULL);
+}
+
+struct pipe *pipe_create()
+{
+	struct pipe *pipe = kmem_cache_alloc(pipe_cache);
+	if (pipe == NULL)
+		return NULL;
+
+	memset(pipe, 0, sizeof(struct pipe));
+	waitq_init(&pipe->rd_wait);
+	waitq_init(&pipe->wr_wait);
+
+	return pipe;
+}
+
+void pipe_destroy(struct pipe *pipe)
+{
+	for (uint32_t i = pipe->tail; i != pipe->head; i++)
+		buddy_free(pipe_buf_at(pipe, i)->page);
+
+	if (pipe->spare)
+		buddy_free(pipe->spare);
+
+	kmem_cache_free(pipe_cache, pipe);
+}
+
+/* a file was opened on the pipe with flags */
+void pipe_open(struct pipe *pipe, int flags)
+{
+	spinlock_acquire(&pipe->lock);
+	if (PIPE_RD(flags))
+		pipe->readers++;
+	if (PIPE_WR(flags))
+		pipe->writers++;
+	spinlock_release(&pipe->lock);
+}
+
+/* The last file open with flags was closed, readers see the end of the data
+ * once there are no writers, and writers fail once there are no readers
+ */
+void pipe_release(struct pipe *pipe, int flags)
+{
+	spinlock_acquire(&pipe->lock);
+	if (PIPE_RD(flags))
+		pipe->readers--;
+	if (PIPE_WR(flags))
+		pipe->writers--;
+	spinlock_release(&pipe->lock);
+
+	waitq_wake_all(&pipe->rd_wait);
+	waitq_wake_all(&pipe->wr_wait);
+}
+
+/* Block until there is data, then read what is there up to count bytes
+ *
+ * Returns 0 at the end of the data, when the pipe is empty and nobody has it
+ * open for writing.
+ */
+ssize_t pipe_read(struct pipe *pipe, void *buf, size_t count)
+{
+	char *dst = buf;
+	size_t read = 0;
+
+	if (count == 0)
+		return 0;
+
+	while (read == 0) {
+		wait_event(&pipe->rd_wait, pipe_readable(pipe));
+
+		spinlock_acquire(&pipe->lock);
+
+		if (pipe->head == pipe->tail && pipe->writers == 0) {
+			spinlock_release(&pipe->lock);
+			return 0;
+		}
+
+		while (read < count && pipe->tail != pipe->head) {
+			struct pipe_buf *b = pipe_buf_at(pipe, pipe->tail);
+
+			if (b->len <= count - read) {
+				/* take the whole page, copy it without the lock */
+				struct pipe_buf take = *b;
+				pipe->tail++;
+				spinlock_release(&pipe->lock);
+
+				memcpy(dst + read, take.page + take.off, take.len);
+				read += take.len;
+
+				spinlock_acquire(&pipe->lock);
+				pipe_page_put(pipe, take.page);
+			} else {
+				size_t n = count - read;
+				memcpy(dst + read, b->page + b->off, n);
+				b->off += n;
+				b->len -= n;
+				read += n;
+			}
+		}
+
+		spinlock_release(&pipe->lock);
+	}
+
+	waitq_wake_all(&pipe->wr_wait);
+	return read;
+}
+
+/* Fill the rest of the last page and then the spare one with up to PIPE_BUF
+ * bytes, called with the lock held, enough space and a spare page
+ */
+static void pipe_write_small(struct pipe *pipe, const char *buf, size_t n)
+{
+	while (n) {
+		struct pipe_buf *b = NULL;
+		if (pipe->head != pipe->tail)
+			b = pipe_buf_at(pipe, pipe->head - 1);
+
+		if (b == NULL || b->off + b->len == PIPE_PAGE_SIZE) {
+			assert(pipe->spare != NULL);
+
+			b = pipe_buf_at(pipe, pipe->head);
+			b->page = pipe->spare;
+			pipe->spare = NULL;
+			b->off = 0;
+			b->len = 0;
+			pipe->head++;
+		}
+
+		size_t chunk = MIN(n, PIPE_PAGE_SIZE - (b->off + b->len));
+		memcpy(b->page + b->off + b->len, buf, chunk);
+		b->len += chunk;
+		buf += chunk;
+		n -= chunk;
+	}
+}
+
+/* Write all of buf, blocking while the pipe is full
+ *
+ * Writes of at most PIPE_BUF bytes go in at once. Longer ones are split in
+ * pages, each filled before the lock is taken and then handed to the ring.
+ * Fails with -EPIPE if nobody has the pipe open for reading.
+ */
+ssize_t pipe_write(struct pipe *pipe, const void *buf, size_t count)
+{
+	const char *src = buf;
+	size_t written = 0;
+
+	while (written < count) {
+		size_t left = count - written;
+
+		if (left < PIPE_PAGE_SIZE || count <= PIPE_BUF) {
+			/* the allocation can't be done under the lock */
+			char *page = NULL;
+			if (__atomic_load_n(&pipe->spare, __ATOMIC_RELAXED) == NULL) {
+				page = buddy_alloc(PIPE_PAGE_SIZE);
+				if (page == NULL)
+					return written ? (ssize_t)written : -ENOMEM;
+			}
+
+			wait_event(&pipe->wr_wait, pipe_writable(pipe, left));
+
+			spinlock_acquire(&pipe->lock);
+			if (pipe->readers == 0) {
+				spinlock_release(&pipe->lock);
+				if (page)
+					buddy_free(page);
+				return written ? (ssize_t)written : -EPIPE;
+			}
+
+			if (page && pipe->spare == NULL) {
+				pipe->spare = page;
+				page = NULL;
+			}
+
+			/* a write that doesn't fit in the last page needs the spare */
+			bool fits = pipe_space(pipe) >= left && (left <= pipe_room(pipe) || pipe->spare);
+			if (fits) {
+				pipe_write_small(pipe, src + written, left);
+				written += left;
+			}
+			spinlock_release(&pipe->lock);
+
+			if (page)
+				buddy_free(page);
+			if (!fits)
+				continue;
+		} else {
+			char *page = buddy_alloc(PIPE_PAGE_SIZE);
+			if (page == NULL)
+				return written ? (ssize_t)written : -ENOMEM;
+
+			memcpy(page, src + written, PIPE_PAGE_SIZE);
+
+			while (1) {
+				wait_event(&pipe->wr_wait, pipe_has_slot(pipe));
+
+				spinlock_acquire(&pipe->lock);
+				if (pipe->readers == 0 || pipe->head - pipe->tail < PIPE_BUFS)
+					break;
+				spinlock_release(&pipe->lock);
+			}
+
+			if (pipe->readers == 0) {
+				spinlock_release(&pipe->lock);
+				buddy_free(page);
+				return written ? (ssize_t)written : -EPIPE;
+			}
+
+			struct pipe_buf *b = pipe_buf_at(pipe, pipe->head);
+			b->page = page;
+			b->off = 0;
+			b->len = PIPE_PAGE_SIZE;
+			pipe->head++;
+			written += PIPE_PAGE_SIZE;
+			spinlock_release(&pipe->lock);
+		}
+
+		waitq_wake_all(&pipe->rd_wait);
+	}
+
+	return written;
+}
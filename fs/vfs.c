@@ -2,23 +2,64 @@
 #include <kernel/slab.h>
 #include <kernel/block.h>
 #include <kernel/rbtree.h>
-#include <kernel/ringbuf.h>
+#include <kernel/reclaim.h>
+#include <kernel/rcu.h>
 
 #include <fs/ext2.h>
 #include <fs/devfs.h>
 #include <fs/vfs.h>
+#include <fs/pipe.h>
 
 #include <lib/stack.h>
 
 static struct fs *rootfs;
-static slab_t *file_slab;
-static slab_t *vnode_slab;
+static struct kmem_cache *file_cache;
+static struct kmem_cache *vnode_cache;
 
 typedef struct fs *(*vfs_init_t)(struct block_device *);
 
 static void vfs_vnode_dec_ref(struct vnode *vnode);
 static void vfs_vnode_dealloc(struct vnode *vnode);
 
+/* Vnodes whose refcount dropped to zero stay attached to their dirent so a
+ * later lookup can reuse them. They are kept on this list, least recently used
+ * first, and only freed by the vnode shrinker. The 0 <-> 1 refcount transitions
+ * happen under vnode_lru_lock, any other change is a plain atomic add
+ */
+static struct vnode *vnode_lru_head = NULL;
+static struct vnode *vnode_lru_tail = NULL;
+static size_t vnode_lru_len = 0;
+static spinlock_t vnode_lru_lock = 0;
+
+static void vnode_lru_add(struct vnode *vnode)
+{
+	vnode->lru_next = NULL;
+	vnode->lru_prev = vnode_lru_tail;
+	if (vnode_lru_tail)
+		vnode_lru_tail->lru_next = vnode;
+	else
+		vnode_lru_head = vnode;
+	vnode_lru_tail = vnode;
+	vnode_lru_len++;
+}
+
+static void vnode_lru_del(struct vnode *vnode)
+{
+	if (vnode->lru_prev)
+		vnode->lru_prev->lru_next = vnode->lru_next;
+	else
+		vnode_lru_head = vnode->lru_next;
+
+	if (vnode->lru_next)
+		vnode->lru_next->lru_prev = vnode->lru_prev;
+	else
+		vnode_lru_tail = vnode->lru_prev;
+
+	vnode->lru_next = NULL;
+	vnode->lru_prev = NULL;
+	vnode_lru_len--;
+}
+
 static void vfs_vnode_dealloc(struct vnode *vnode)
 {
 	if (!vnode)
@@ -27,22 +68,12 @@ static void vfs_vnode_dealloc(struct vnode *vnode)
 	if (vnode->no_free)
 		return;
 
-	if (vnode->parent) {
-		spinlock_acquire(&vnode->parent->lock);
-		for (size_t i = 0; i < vnode->parent->num_dirents; i++) {
-			if (vnode->parent->dirents[i].vnode == vnode) {
-				vnode->parent->dirents[i].vnode = NULL;
-				break;
-			}
-		}
-		spinlock_release(&vnode->parent->lock);
-
+	if (vnode->parent)
 		vfs_vnode_dec_ref(vnode->parent);
-	}
 
 	ATTEMPT_FREE(vnode->dirents);
 
-	slab_free(vnode_slab, vnode);
+	kmem_cache_free(vnode_cache, vnode);
 }
 
 static void vfs_vnode_dec_ref(struct vnode *vnode)
@@ -53,15 +84,171 @@ static void vfs_vnode_dec_ref(struct vnode *vnode)
 	if (vnode->no_free)
 		return;
 
-	spinlock_acquire(&vnode->lock);
-	vnode->refcount--;
-	spinlock_release(&vnode->lock);
+	/* not the last reference */
+	if (atomic_add_unless(&vnode->refcount, -1, 1))
+		return;
+
+	spinlock_acquire(&vnode_lru_lock);
+	if (atomic_dec_and_test(&vnode->refcount))
+		vnode_lru_add(vnode);
+	spinlock_release(&vnode_lru_lock);
+}
+
+/* Index of the entry called name in dir, or -1
+ *
+ * The scan takes no lock. Entries are only appended, by publishing a grown
+ * copy of the array, and the old array is freed after an RCU grace period.
+ * The vnode pointers of the entries are only used under dir->lock.
+ */
+static ssize_t vfs_dirent_find(struct vnode *dir, const char *name, uint64_t *inode)
+{
+	ssize_t ret = -1;
+
+	rcu_read_lock();
+
+	size_t num_dirents = __atomic_load_n(&dir->num_dirents, __ATOMIC_ACQUIRE);
+	struct dirent *dirents = rcu_dereference(dir->dirents);
+
+	for (size_t i = 0; i < num_dirents; i++) {
+		if (strcmp(dirents[i].name, name) == 0) {
+			ATTEMPT_WRITE(inode, dirents[i].inode);
+			ret = i;
+			break;
+		}
+	}
+
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/* append a copy of dirent to dir, called with dir->lock held */
+int vfs_dirent_append(struct vnode *dir, const struct dirent *dirent)
+{
+	size_t num_dirents = dir->num_dirents;
+	struct dirent *old = dir->dirents;
+
+	struct dirent *dirents = kmalloc((num_dirents + 1) * sizeof(struct dirent), ALLOC_KERN);
+	if (!dirents)
+		return -ENOMEM;
+
+	if (num_dirents)
+		memcpy(dirents, old, num_dirents * sizeof(struct dirent));
+	memcpy(&dirents[num_dirents], dirent, sizeof(struct dirent));
+
+	/* the array before the count, see vfs_dirent_find */
+	rcu_assign_pointer(dir->dirents, dirents);
+	__atomic_store_n(&dir->num_dirents, num_dirents + 1, __ATOMIC_RELEASE);
+
+	if (old)
+		kfree_rcu(old);
+
+	return 0;
+}
+
+/* take a reference to the vnode cached in an entry of dir, reviving it if
+ * unused. Unused vnodes are revived under vnode_lru_lock so the shrinker can't
+ * free them first
+ */
+static struct vnode *vfs_dirent_get(struct vnode *dir, size_t index)
+{
+	spinlock_acquire(&dir->lock);
+
+	struct vnode *vnode = dir->dirents[index].vnode;
+	if (vnode && !atomic_inc_not_zero(&vnode->refcount)) {
+		spinlock_acquire(&vnode_lru_lock);
+		if (atomic_fetch_add(&vnode->refcount, 1) == 0 && !vnode->no_free)
+			vnode_lru_del(vnode);
+		spinlock_release(&vnode_lru_lock);
+	}
+
+	spinlock_release(&dir->lock);
+
+	return vnode;
+}
+
+/* cache a newly opened vnode in an entry of dir, unless another lookup got
+ * there first. Returns the vnode that ends up cached, with a reference
+ */
+static struct vnode *vfs_dirent_set(struct vnode *dir, size_t index, struct vnode *vnode)
+{
+	spinlock_acquire(&dir->lock);
+
+	struct dirent *entry = &dir->dirents[index];
+	if (entry->vnode == NULL) {
+		entry->vnode = vnode;
+		spinlock_release(&dir->lock);
+		return vnode;
+	}
+
+	spinlock_release(&dir->lock);
+
+	vnode->parent = NULL;
+	vfs_vnode_dealloc(vnode);
+
+	return vfs_dirent_get(dir, index);
+}
+
+static size_t vnode_lru_count()
+{
+	return vnode_lru_len;
+}
+
+/* detach up to nr unused vnodes from their parents and free them */
+static size_t vnode_lru_scan(size_t nr)
+{
+	struct vnode *release = NULL;
+	size_t freed = 0;
+
+	if (!spinlock_try_acquire(&vnode_lru_lock))
+		return 0;
+
+	struct vnode *vnode = vnode_lru_head;
+	while (vnode != NULL && freed < nr) {
+		struct vnode *next = vnode->lru_next;
+		struct vnode *parent = vnode->parent;
+
+		/* skip vnodes whose parent is busy, we may be called with it held */
+		if (parent && !spinlock_try_acquire(&parent->lock)) {
+			vnode = next;
+			continue;
+		}
+
+		if (parent) {
+			for (size_t i = 0; i < parent->num_dirents; i++) {
+				if (parent->dirents[i].vnode == vnode) {
+					parent->dirents[i].vnode = NULL;
+					break;
+				}
+			}
+			spinlock_release(&parent->lock);
+		}
+
+		vnode_lru_del(vnode);
+		vnode->lru_next = release;
+		release = vnode;
+		freed++;
+
+		vnode = next;
+	}
+
+	spinlock_release(&vnode_lru_lock);
+
+	while (release != NULL) {
+		struct vnode *next = release->lru_next;
+		vfs_vnode_dealloc(release);
+		release = next;
+	}
 
-	/* will recursively free all vnodes */
-	if (vnode->refcount == 0)
-		vfs_vnode_dealloc(vnode);
+	return freed;
 }
 
+static struct shrinker vnode_shrinker = {
+	.name = "vnode-lru",
+	.count = vnode_lru_count,
+	.scan = vnode_lru_scan,
+};
+
 struct vnode *vfs_lookup(const char *name, int *err)
 {
 	struct vnode *cur_vnode = rootfs->root;
@@ -73,61 +260,51 @@ struct vnode *vfs_lookup(const char *name, int *err)
 	char *tok_last = NULL;
 	char *tok = strtok(path_copy, "/", &tok_last);
 
-	struct dirent *entry = NULL;
-
 	while (!strempty(tok)) {
-		bool found = false;
-		for (int i = 0; i < cur_vnode->num_dirents; i++) {
-			entry = &cur_vnode->dirents[i];
-			if (strcmp(entry->name, tok) == 0) {
-				if (entry->vnode) {
-					/* go to next vnode */
-					cur_vnode = entry->vnode;
-
-					if (cur_vnode->mount_ptr) {
-						fs = cur_vnode->ptr->fs;
-						cur_vnode = cur_vnode->ptr;
-					}
-
-					spinlock_acquire(&cur_vnode->lock);
-					cur_vnode->refcount++;
-					spinlock_release(&cur_vnode->lock);
-				} else {
-					/* try to open the vnode */
-					struct vnode *new_vnode = slab_alloc(vnode_slab);
-					if (!new_vnode) {
-						ATTEMPT_WRITE(err, -ENOMEM);
-						kfree(path_copy);
-						return NULL;
-					}
-					memset(new_vnode, 0, sizeof(struct vnode));
-					new_vnode->refcount = 1;
-					new_vnode->parent = cur_vnode;
-
-					int res = fs->ops->open_vno(fs, new_vnode, entry->inode);
-					if (res < 0) {
-						ATTEMPT_WRITE(err, res);
-						slab_free(vnode_slab, new_vnode);
-						kfree(path_copy);
-						return NULL;
-					}
-
-					cur_vnode = new_vnode;
-					entry->vnode = cur_vnode;
-				}
+		uint64_t inode;
+		ssize_t index = vfs_dirent_find(cur_vnode, tok, &inode);
 
-				found = true;
-				break;
-			}
-		}
-
-		if (!found) {
+		if (index < 0) {
 			ATTEMPT_WRITE(err, -ENOENT);
 			vfs_vnode_dec_ref(cur_vnode);
 			kfree(path_copy);
 			return NULL;
 		}
 
+		struct vnode *next_vnode = vfs_dirent_get(cur_vnode, index);
+		if (next_vnode == NULL) {
+			/* try to open the vnode */
+			struct vnode *new_vnode = kmem_cache_alloc(vnode_cache);
+			if (!new_vnode) {
+				ATTEMPT_WRITE(err, -ENOMEM);
+				kfree(path_copy);
+				return NULL;
+			}
+			memset(new_vnode, 0, sizeof(struct vnode));
+			atomic_set(&new_vnode->refcount, 1);
+			new_vnode->parent = cur_vnode;
+
+			int res = fs->ops->open_vno(fs, new_vnode, inode);
+			if (res < 0) {
+				ATTEMPT_WRITE(err, res);
+				kmem_cache_free(vnode_cache, new_vnode);
+				kfree(path_copy);
+				return NULL;
+			}
+
+			next_vnode = vfs_dirent_set(cur_vnode, index, new_vnode);
+		}
+
+		/* go to next vnode */
+		cur_vnode = next_vnode;
+
+		if (cur_vnode->mount_ptr) {
+			fs = cur_vnode->ptr->fs;
+			cur_vnode = cur_vnode->ptr;
+
+			atomic_inc(&cur_vnode->refcount);
+		}
+
 		/* get next token */
 		tok = strtok(NULL, "/", &tok_last);
 	}
@@ -139,7 +316,7 @@ struct vnode *vfs_lookup(const char *name, int *err)
 struct file *vfs_open(const char *pathname, int *err)
 {
 	/* allocate a file */
-	struct file *file = slab_alloc(file_slab);
+	struct file *file = kmem_cache_alloc(file_cache);
 
 	if (!file) {
 		kprintf(LOG_ERROR "Failed to allocate file struct\n");
@@ -161,7 +338,7 @@ struct file *vfs_open(const char *pathname, int *err)
 
 	struct vnode *vno = vfs_lookup(pathname, err);
 	if (!vno) {
-		slab_free(file_slab, file);
+		kmem_cache_free(file_cache, file);
 		return NULL;
 	}
 
@@ -178,9 +355,62 @@ int vfs_close(struct file *file)
 	if (!file)
 		return -EBADF;
 
-	vfs_vnode_dec_ref(file->vnode);
+	struct vnode *vnode = file->vnode;
+
+	if (file->type == VFS_VNO_FIFO && file->flags)
+		pipe_release(vnode->priv_data, file->flags);
+
+	/* anonymous pipes aren't in any directory, they go with their last file */
+	if (file->type == VFS_VNO_FIFO && vnode->fs == NULL) {
+		if (atomic_dec_and_test(&vnode->refcount)) {
+			pipe_destroy(vnode->priv_data);
+			kmem_cache_free(vnode_cache, vnode);
+		}
+	} else {
+		vfs_vnode_dec_ref(vnode);
+	}
+
+	kmem_cache_free(file_cache, file);
+	return 0;
+}
+
+/* Create an anonymous pipe, files[0] is the end for reading and files[1] the
+ * end for writing
+ */
+int vfs_pipe(struct file *files[2])
+{
+	struct vnode *vnode = vfs_create_vno();
+	if (!vnode)
+		return -ENOMEM;
+
+	struct pipe *pipe = pipe_create();
+	files[0] = kmem_cache_alloc(file_cache);
+	files[1] = kmem_cache_alloc(file_cache);
+
+	if (!pipe || !files[0] || !files[1]) {
+		if (pipe)
+			pipe_destroy(pipe);
+		for (int i = 0; i < 2; i++) {
+			if (files[i])
+				kmem_cache_free(file_cache, files[i]);
+		}
+		kmem_cache_free(vnode_cache, vnode);
+		return -ENOMEM;
+	}
+
+	vnode->flags = VFS_VNO_FIFO;
+	vnode->priv_data = pipe;
+	atomic_set(&vnode->refcount, 2);
+
+	static const int flags[2] = { O_RDONLY, O_WRONLY };
+	for (int i = 0; i < 2; i++) {
+		memset(files[i], 0, sizeof(struct file));
+		files[i]->vnode = vnode;
+		files[i]->type = VFS_VNO_FIFO;
+		files[i]->flags = flags[i];
+		pipe_open(pipe, flags[i]);
+	}
 
-	slab_free(file_slab, file);
 	return 0;
 }
 
@@ -189,9 +419,8 @@ ssize_t vfs_write(struct file *file, void *buf, off_t off, size_t count)
 	if ((file->vnode->flags & VFS_VTYPE_MASK) == VFS_VNO_DIR)
 		return -EISDIR;
 
-	if (file->vnode->flags & VFS_VNO_FIFO) {
-		return ringbuf_write(file->vnode->priv_data, buf, count);
-	}
+	if (file->type == VFS_VNO_FIFO)
+		return pipe_write(file->vnode->priv_data, buf, count);
 
 	return file->vnode->fs->ops->write(file->vnode, buf, off, count);
 }
@@ -204,12 +433,11 @@ ssize_t vfs_read(struct file *file, void *buf, off_t off, size_t count)
 	if (off >= file->vnode->size && file->type == VFS_VNO_REG)
 		return 0;
 
-	/* read from fifo */
-	if (file->vnode->flags & VFS_VNO_FIFO) {
-		return ringbuf_read(file->vnode->priv_data, buf, count);
-	}
+	if (file->type == VFS_VNO_FIFO)
+		return pipe_read(file->vnode->priv_data, buf, count);
 
-	if (off + count > file->vnode->size)
+	/* device nodes have no size, the driver decides where they end */
+	if (file->type == VFS_VNO_REG && off + count > file->vnode->size)
 		count = file->vnode->size - off;
 
 	return file->vnode->fs->ops->read(file->vnode, buf, off, count);
@@ -225,11 +453,11 @@ struct vnode *vfs_create_file(struct vnode *parent, const char *path, mode_t mod
 
 	/* find the new vnode */
 	struct vnode *vnode = NULL;
-	for (int i = 0; i < parent->num_dirents; i++) {
-		if (strcmp(parent->dirents[i].name, path) == 0) {
-			vnode = parent->dirents[i].vnode;
-			break;
-		}
+	ssize_t index = vfs_dirent_find(parent, path, NULL);
+	if (index >= 0) {
+		spinlock_acquire(&parent->lock);
+		vnode = parent->dirents[index].vnode;
+		spinlock_release(&parent->lock);
 	}
 
 	return vnode;
@@ -308,43 +536,36 @@ struct vnode *vfs_mknod(const char *pathname, mode_t mode)
 		return NULL;
 	}
 
-	vnode->refcount = 1;
+	atomic_set(&vnode->refcount, 1);
 	vnode->fs = dir_vnode->fs;
 	vnode->flags = mode;
-	vnode->priv_data = ringbuf_create(0x4000);
-
-	/* create directory entry */
-	struct dirent *dirents = dir_vnode->dirents;
-	int num_dirents = dir_vnode->num_dirents;
-
-	/* search for existing entry */
-	for (int i = 0; i < num_dirents; i++) {
-		if (strcmp(dirents[i].name, name) == 0) {
+	if ((mode & VFS_VTYPE_MASK) == VFS_VNO_FIFO) {
+		vnode->priv_data = pipe_create();
+		if (vnode->priv_data == NULL) {
 			vfs_close(dir_file);
-			slab_free(vnode_slab, vnode);
+			kmem_cache_free(vnode_cache, vnode);
 			return NULL;
 		}
 	}
 
+	/* create directory entry */
+	struct dirent dirent;
+	memset(&dirent, 0, sizeof(struct dirent));
+	dirent.vnode = vnode;
+	dirent.reclen = sizeof(struct dirent);
+	dirent.inode = 0;
+	strcpy(dirent.name, name);
+
 	spinlock_acquire(&dir_vnode->lock);
 
-	dirents = krealloc(dirents, (num_dirents + 1) * sizeof(struct dirent), ALLOC_KERN);
-	if (!dirents) {
+	/* search for existing entry, entries are only added under the lock */
+	if (vfs_dirent_find(dir_vnode, name, NULL) >= 0 || vfs_dirent_append(dir_vnode, &dirent) < 0) {
+		spinlock_release(&dir_vnode->lock);
 		vfs_close(dir_file);
-		slab_free(vnode_slab, vnode);
+		kmem_cache_free(vnode_cache, vnode);
 		return NULL;
 	}
 
-	dir_vnode->dirents = dirents;
-
-	struct dirent *dirent = &dirents[num_dirents];
-	memset(dirent, 0, sizeof(struct dirent));
-	dirent->vnode = vnode;
-	dirent->reclen = sizeof(struct dirent);
-	dirent->inode = 0;
-	strcpy(dirent->name, name);
-
-	dir_vnode->num_dirents++;
 	spinlock_release(&dir_vnode->lock);
 
 	vfs_close(dir_file);
@@ -354,7 +575,7 @@ struct vnode *vfs_mknod(const char *pathname, mode_t mode)
 
 struct vnode *vfs_create_vno()
 {
-	struct vnode *vnode = slab_alloc(vnode_slab);
+	struct vnode *vnode = kmem_cache_alloc(vnode_cache);
 	if (!vnode)
 		return NULL;
 
@@ -378,7 +599,7 @@ struct fs *vfs_create()
 		goto out_ops;
 
 	fs->root->no_free = true;
-	fs->root->refcount = 1;
+	atomic_set(&fs->root->refcount, 1);
 
 	return fs;
 
@@ -394,7 +615,7 @@ void vfs_dealloc(struct fs *fs)
 	ATTEMPT_FREE(fs->ops);
 	if (fs->root)
 		ATTEMPT_FREE(fs->root->dirents);
-	slab_free(vnode_slab, fs->root);
+	kmem_cache_free(vnode_cache, fs->root);
 
 	ATTEMPT_FREE(fs->mount_point);
 	ATTEMPT_FREE(fs);
@@ -489,8 +710,10 @@ out:
 
 void vfs_init(const char *rootdev_name)
 {
-	file_slab = slab_create(sizeof(struct file), 16 * KB, 0);
-	vnode_slab = slab_create(sizeof(struct vnode), 16 * KB, 0);
+	file_cache = kmem_cache_create("file", sizeof(struct file), 0, 0, NULL);
+	vnode_cache = kmem_cache_create("vnode", sizeof(struct vnode), 0, 0, NULL);
+	pipe_init();
+	shrinker_register(&vnode_shrinker);
 
 #ifdef KDEBUG
 	kprintf(LOG_DEBUG "Found root device %s\n", rootdev_name);
@@ -3,6 +3,7 @@
 #define _AHCI_H_
 
 #include <kernel/common.h>
+#include <kernel/wait.h>
 #include <dev/pci.h>
 
 /* Frame information structure (FIS) */
@@ -45,6 +46,9 @@
 #define HBA_PORT_CMD_CR 0x8000
 #define HBA_PORT_IS_TFES 0x40000000
 
+#define HBA_PORT_IE_DHRE 0x1
+#define HBA_PORT_IE_TFEE 0x40000000
+
 struct fis_reg_h2d {
 	/* 0x00 */
 	uint8_t fis_type;
@@ -337,6 +341,10 @@ struct sata_device {
 	size_t sector_size;
 	size_t sector_count;
 	hbamem_t *abar;
+
+	/* woken by the completion interrupt */
+	waitq_t wq;
+	volatile bool error;
 };
 
 void ahci_init();
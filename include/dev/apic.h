@@ -26,6 +26,7 @@
 #define LAPIC_ERR 0x280
 #define LAPIC_CMCI 0x2F0
 #define LAPIC_ICR 0x300
+#define LAPIC_ICR_HIGH 0x310
 #define LAPIC_THERMAL 0x330
 #define LAPIC_LVT_PERF_MON_COUNT 0x340
 #define LAPIC_LVT_LINT0 0x350
@@ -38,6 +39,15 @@
 #define LAPIC_TIMER_DIV 0x3E0
 #define LAPIC_TIMER_INIT_COUNT 0x380
 
+#define LAPIC_TIMER_VECTOR 0x20
+#define LAPIC_TIMER_MASKED 0x10000
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_TSC_DEADLINE 0x40000
+#define LAPIC_TIMER_DIV_16 0x3
+
+#define LAPIC_ICR_PENDING 0x1000
+#define LAPIC_ICR_ASSERT 0x4000
+
 #define MSR_IA32_APIC_BASE 0x1B
 
 #ifndef __ASM__
@@ -134,6 +144,9 @@ void lapic_eoi();
 int madt_parse_next_entry(int offset);
 void lapic_enable();
 void apic_enable_timer();
+void apic_timer_oneshot(uint64_t ns);
+void apic_timer_stop();
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector);
 uint8_t lapic_idno();
 
 #endif /* __ASM__ */
@@ -7,6 +7,18 @@
 #define PCIPM_CONFIG_ADDRESS 0xCF8
 #define PCIPM_CONFIG_DATA 0xCFC
 
+#define PCI_CMD_INTX_DISABLE 0x400
+#define PCI_STATUS_CAP_LIST 0x10
+
+#define PCI_CAP_MSI 0x05
+
+/* MSI message control, upper half of the first capability dword */
+#define PCI_MSI_ENABLE 0x01
+#define PCI_MSI_MME_MASK 0x70
+#define PCI_MSI_64BIT 0x80
+
+#define PCI_MSI_ADDRESS 0xFEE00000
+
 struct pci_device {
 	uint8_t bus;
 	uint8_t slot;
@@ -114,7 +126,8 @@ struct pci_header_type_1 {
 
 void pci_init();
 uint32_t pci_config_read_long(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
-void pci_config_write_long(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t data);
+void pci_config_write_long(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t data);
 struct pci_device *pci_find_device(uint8_t class, uint8_t subclass);
+int pci_enable_msi(struct pci_device *dev, uint8_t vector, uint8_t apic_id);
 
 #endif /* _PCI_H_ */
@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _PIT_H_
+#define _PIT_H_
+
+#include <kernel/common.h>
+
+#define PIT_HZ 1193182
+
+#define PIT_CH2_DATA 0x42
+#define PIT_CMD 0x43
+#define PIT_CH2_GATE 0x61
+
+#ifndef __ASM__
+
+void pit_oneshot(uint16_t count);
+bool pit_expired();
+
+#endif /* __ASM__ */
+#endif /* _PIT_H_ */
@@ -4,6 +4,31 @@
 
 #define COM1 0x3F8
 
+/* register offsets */
+#define UART_DATA 0
+#define UART_IER 1
+#define UART_IIR 2
+#define UART_LSR 5
+#define UART_MSR 6
+
+#define UART_IER_RX 0x01
+#define UART_IER_THRE 0x02
+
+/* interrupt identification, the cause is only valid without UART_IIR_NONE */
+#define UART_IIR_NONE 0x01
+#define UART_IIR_ID 0x0E
+#define UART_IIR_MSR 0x00
+#define UART_IIR_THRE 0x02
+#define UART_IIR_RX 0x04
+#define UART_IIR_LSR 0x06
+#define UART_IIR_TIMEOUT 0x0C
+
+#define UART_LSR_DR 0x01
+#define UART_LSR_THRE 0x20
+
+#define UART_FIFO_SIZE 16
+#define SERIAL_TX_SIZE 0x4000
+
 #ifndef __ASM__
 
 #include <kernel/common.h>
@@ -12,6 +37,7 @@ void isr_serial_input();
 void isr_serial_input_1();
 ssize_t serial_write(const char *buf, size_t count);
 void serial_putchar(char c);
+void serial_sync();
 void serial_trap();
 int serial_init();
 
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+#include <kernel/common.h>
+#include <kernel/wait.h>
+
+#define PIPE_PAGE_SIZE 0x1000
+#define PIPE_BUFS 16 /* power of two, at most 64 KiB in flight */
+
+/* writes up to this size are not interleaved with other writers */
+#define PIPE_BUF PIPE_PAGE_SIZE
+
+/* a page holding len bytes of data starting at off */
+struct pipe_buf {
+	char *page;
+	uint32_t off;
+	uint32_t len;
+};
+
+/* Pipe and FIFO buffer
+ *
+ * Data lives in a ring of pages that are allocated as it is written and freed
+ * as it is read, an idle pipe holds no memory besides one spare page. head and
+ * tail index bufs freely, head - tail pages are in use. readers and writers
+ * count the open files on each end.
+ */
+struct pipe {
+	spinlock_t lock;
+
+	struct pipe_buf bufs[PIPE_BUFS];
+	uint32_t head;
+	uint32_t tail;
+	char *spare;
+
+	uint32_t readers;
+	uint32_t writers;
+
+	waitq_t rd_wait;
+	waitq_t wr_wait;
+};
+
+void pipe_init();
+struct pipe *pipe_create();
+void pipe_destroy(struct pipe *pipe);
+void pipe_open(struct pipe *pipe, int flags);
+void pipe_release(struct pipe *pipe, int flags);
+ssize_t pipe_read(struct pipe *pipe, void *buf, size_t count);
+ssize_t pipe_write(struct pipe *pipe, const void *buf, size_t count);
+
+#endif /* _PIPE_H_ */
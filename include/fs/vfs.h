@@ -3,6 +3,7 @@
 #define _VFS_H_
 
 #include <kernel/common.h>
+#include <kernel/atomic.h>
 
 #define VFSE_IS_BDEV 0xFFFA
 
@@ -77,8 +78,12 @@ struct vnode {
 
 	void *priv_data;
 
-	size_t refcount;
+	atomic_t refcount;
 	spinlock_t lock;
+
+	/* unused vnodes are kept cached on an LRU list until reclaimed */
+	struct vnode *lru_next;
+	struct vnode *lru_prev;
 };
 
 struct dirent {
@@ -93,12 +98,12 @@ struct dirent {
 struct file {
 	struct vnode *vnode;
 
-	spinlock_t ref_lock;
-	uint64_t refcount;
+	atomic_t refcount;
 
 	ino_t ino_num; /* inode number */
 	uint32_t type; /* type of the file */
 	uint64_t size; /* size of the file */
+	uint32_t flags; /* O_* it was opened with, 0 when opened by the kernel */
 };
 
 struct file_descriptor {
@@ -143,6 +148,7 @@ struct file *vfs_open(const char *pathname, int *err);
 struct vnode *vfs_create_file(struct vnode *parent, const char *path, mode_t mode);
 struct vnode *vfs_mknod(const char *pathname, mode_t mode);
 int vfs_close(struct file *file);
+int vfs_pipe(struct file *files[2]);
 int unlink(const char *pathname);
 int statfd(struct file_descriptor *fdesc, struct statbuf *statbuf);
 
@@ -151,6 +157,7 @@ char *dirname(char *path);
 
 struct fs *vfs_create();
 struct vnode *vfs_create_vno();
+int vfs_dirent_append(struct vnode *dir, const struct dirent *dirent);
 void vfs_dealloc(struct fs *fs);
 int vfs_mount(struct fs *fs, const char *mount_point);
 
@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _ATOMIC_H_
+#define _ATOMIC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Atomic counters. All of these compile down to a single locked instruction
+ * (or a plain mov for reads and writes) and are fully inlined. Operations that
+ * return a value are ordered like a full barrier unless their name says
+ * otherwise, the ones that don't return anything are relaxed.
+ */
+typedef struct {
+	volatile int32_t counter;
+} atomic_t;
+
+typedef struct {
+	volatile int64_t counter;
+} atomic64_t;
+
+#define ATOMIC_INIT(i) { (i) }
+
+/* compiler-only barrier */
+#define barrier() __asm__ volatile("" ::: "memory")
+
+/* x86 only reorders stores after later loads, so only smp_mb() needs a
+ * fence instruction
+ */
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static inline int32_t atomic_read(const atomic_t *v)
+{
+	return __atomic_load_n(&v->counter, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_set(atomic_t *v, int32_t i)
+{
+	__atomic_store_n(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_inc(atomic_t *v)
+{
+	__atomic_add_fetch(&v->counter, 1, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_dec(atomic_t *v)
+{
+	__atomic_sub_fetch(&v->counter, 1, __ATOMIC_RELAXED);
+}
+
+/* returns the value before the addition */
+static inline int32_t atomic_fetch_add(atomic_t *v, int32_t i)
+{
+	return __atomic_fetch_add(&v->counter, i, __ATOMIC_SEQ_CST);
+}
+
+/* returns the value after the addition */
+static inline int32_t atomic_add_return(atomic_t *v, int32_t i)
+{
+	return __atomic_add_fetch(&v->counter, i, __ATOMIC_SEQ_CST);
+}
+
+/* returns true if the counter dropped to zero */
+static inline bool atomic_dec_and_test(atomic_t *v)
+{
+	return __atomic_sub_fetch(&v->counter, 1, __ATOMIC_SEQ_CST) == 0;
+}
+
+static inline int32_t atomic_xchg(atomic_t *v, int32_t i)
+{
+	return __atomic_exchange_n(&v->counter, i, __ATOMIC_SEQ_CST);
+}
+
+/* returns the value found, the exchange happened if it equals old */
+static inline int32_t atomic_cmpxchg(atomic_t *v, int32_t old, int32_t new)
+{
+	__atomic_compare_exchange_n(&v->counter, &old, new, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return old;
+}
+
+/* add i unless the counter is u, returns true if it was added */
+static inline bool atomic_add_unless(atomic_t *v, int32_t i, int32_t u)
+{
+	int32_t c = atomic_read(v);
+
+	do {
+		if (c == u)
+			return false;
+	} while (!__atomic_compare_exchange_n(&v->counter, &c, c + i, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	return true;
+}
+
+static inline bool atomic_inc_not_zero(atomic_t *v)
+{
+	return atomic_add_unless(v, 1, 0);
+}
+
+static inline int64_t atomic64_read(const atomic64_t *v)
+{
+	return __atomic_load_n(&v->counter, __ATOMIC_RELAXED);
+}
+
+static inline void atomic64_set(atomic64_t *v, int64_t i)
+{
+	__atomic_store_n(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline void atomic64_inc(atomic64_t *v)
+{
+	__atomic_add_fetch(&v->counter, 1, __ATOMIC_RELAXED);
+}
+
+static inline void atomic64_dec(atomic64_t *v)
+{
+	__atomic_sub_fetch(&v->counter, 1, __ATOMIC_RELAXED);
+}
+
+static inline int64_t atomic64_fetch_add(atomic64_t *v, int64_t i)
+{
+	return __atomic_fetch_add(&v->counter, i, __ATOMIC_SEQ_CST);
+}
+
+static inline int64_t atomic64_add_return(atomic64_t *v, int64_t i)
+{
+	return __atomic_add_fetch(&v->counter, i, __ATOMIC_SEQ_CST);
+}
+
+static inline bool atomic64_dec_and_test(atomic64_t *v)
+{
+	return __atomic_sub_fetch(&v->counter, 1, __ATOMIC_SEQ_CST) == 0;
+}
+
+static inline int64_t atomic64_xchg(atomic64_t *v, int64_t i)
+{
+	return __atomic_exchange_n(&v->counter, i, __ATOMIC_SEQ_CST);
+}
+
+static inline int64_t atomic64_cmpxchg(atomic64_t *v, int64_t old, int64_t new)
+{
+	__atomic_compare_exchange_n(&v->counter, &old, new, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return old;
+}
+
+/* Bit operations on a word of flags. nr must be below 64 */
+static inline void set_bit(unsigned nr, volatile uint64_t *addr)
+{
+	__atomic_fetch_or(addr, 1ull << nr, __ATOMIC_RELAXED);
+}
+
+static inline void clear_bit(unsigned nr, volatile uint64_t *addr)
+{
+	__atomic_fetch_and(addr, ~(1ull << nr), __ATOMIC_RELEASE);
+}
+
+static inline bool test_bit(unsigned nr, const volatile uint64_t *addr)
+{
+	return (__atomic_load_n(addr, __ATOMIC_RELAXED) >> nr) & 1;
+}
+
+/* returns the previous state of the bit. Setting is an acquire and clearing
+ * a release, so a bit can be used as a try-lock
+ */
+static inline bool test_and_set_bit(unsigned nr, volatile uint64_t *addr)
+{
+	return (__atomic_fetch_or(addr, 1ull << nr, __ATOMIC_ACQUIRE) >> nr) & 1;
+}
+
+static inline bool test_and_clear_bit(unsigned nr, volatile uint64_t *addr)
+{
+	return (__atomic_fetch_and(addr, ~(1ull << nr), __ATOMIC_RELEASE) >> nr) & 1;
+}
+
+#endif /* _ATOMIC_H_ */
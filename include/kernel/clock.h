@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _CLOCK_H_
+#define _CLOCK_H_
+
+#include <kernel/common.h>
+
+#define NSEC_PER_SEC 1000000000ull
+#define NSEC_PER_MSEC 1000000ull
+#define NSEC_PER_USEC 1000ull
+
+#ifndef __ASM__
+
+void clock_init(uint64_t tsc_hz);
+uint64_t clock_ns();
+uint64_t clock_ns_to_cycles(uint64_t ns);
+
+#endif /* __ASM__ */
+#endif /* _CLOCK_H_ */
@@ -3,6 +3,7 @@
 #define _COMMON_H_
 
 #define KSTACK_SIZE 0x4000
+#define CACHELINE_SIZE 64
 
 #include <limine/limine.h>
 
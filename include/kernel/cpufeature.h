@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _CPUFEATURE_H_
+#define _CPUFEATURE_H_
+
+/* bit numbers in the feature mask */
+#define CPU_FEATURE_FXSR 0
+#define CPU_FEATURE_XSAVE 1
+#define CPU_FEATURE_XSAVEOPT 2
+#define CPU_FEATURE_AVX 3
+#define CPU_FEATURE_ERMS 4
+#define CPU_FEATURE_PCID 5
+#define CPU_FEATURE_INVPCID 6
+#define CPU_FEATURE_FSGSBASE 7
+#define CPU_FEATURE_X2APIC 8
+#define CPU_FEATURE_TSC_DEADLINE 9
+#define CPU_FEATURE_INVARIANT_TSC 10
+#define CPU_FEATURE_PDPE1GB 11
+
+#ifdef __ASM__
+
+/* ALTERNATIVE oldinstr, newinstr, feature
+ *
+ * Assembles oldinstr, padded with NOPs to the length of newinstr if that is
+ * longer. If the boot CPU has the feature, alternatives_apply copies newinstr
+ * over it. newinstr must be position independent except for a lone jmp or
+ * call, whose displacement is fixed up.
+ */
+.macro ALTERNATIVE oldinstr, newinstr, feature
+661:
+	\oldinstr
+662:
+	.skip -(((664f - 663f) - (662b - 661b)) > 0) * ((664f - 663f) - (662b - 661b)), 0x90
+665:
+	.pushsection .altinstructions, "a"
+	.balign 8
+	.quad 661b
+	.quad 663f
+	.word \feature
+	.byte 665b - 661b
+	.byte 664f - 663f
+	.long 0
+	.popsection
+	.pushsection .altinstr_replacement, "ax"
+663:
+	\newinstr
+664:
+	.popsection
+.endm
+
+#else
+
+#include <kernel/common.h>
+
+/* an entry of .altinstructions, see ALTERNATIVE */
+struct alt_instr {
+	uint8_t *orig;
+	uint8_t *repl;
+	uint16_t feature;
+	uint8_t orig_len;
+	uint8_t repl_len;
+	uint32_t pad;
+} __attribute__((packed));
+
+extern uint64_t boot_cpu_features;
+
+uint64_t cpufeature_probe();
+void cpufeature_init();
+void alternatives_apply();
+void text_poke(void *dst, const void *src, size_t len);
+
+/* features of the BSP, which every CPU is assumed to share */
+static inline bool boot_cpu_has(int feature)
+{
+	return boot_cpu_features & (1ull << feature);
+}
+
+#endif /* __ASM__ */
+#endif /* _CPUFEATURE_H_ */
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _CPUID_H_
+#define _CPUID_H_
+
+#include <kernel/common.h>
+
+#define CPUID_LEAF_MAX 0x00
+#define CPUID_LEAF_FEATURES 0x01
+#define CPUID_LEAF_EXT_FEATURES 0x07
+#define CPUID_LEAF_XSTATE 0x0D
+#define CPUID_LEAF_EXT_MAX 0x80000000
+#define CPUID_LEAF_EXT_INFO 0x80000001
+#define CPUID_LEAF_APM 0x80000007
+
+/* CPUID_LEAF_FEATURES */
+#define CPUID_FEAT_EDX_TSC (1 << 4)
+#define CPUID_FEAT_EDX_FXSR (1 << 24)
+#define CPUID_FEAT_ECX_PCID (1 << 17)
+#define CPUID_FEAT_ECX_X2APIC (1 << 21)
+#define CPUID_FEAT_ECX_TSC_DEADLINE (1 << 24)
+#define CPUID_FEAT_ECX_XSAVE (1 << 26)
+#define CPUID_FEAT_ECX_AVX (1 << 28)
+
+/* CPUID_LEAF_EXT_FEATURES, subleaf 0 */
+#define CPUID_EXTFEAT_EBX_FSGSBASE (1 << 0)
+#define CPUID_EXTFEAT_EBX_ERMS (1 << 9)
+#define CPUID_EXTFEAT_EBX_INVPCID (1 << 10)
+
+/* CPUID_LEAF_XSTATE, subleaf 1 */
+#define CPUID_XSTATE_EAX_XSAVEOPT (1 << 0)
+
+/* CPUID_LEAF_EXT_INFO */
+#define CPUID_EXTINFO_EDX_PDPE1GB (1 << 26)
+
+/* CPUID_LEAF_APM */
+#define CPUID_APM_EDX_INVARIANT_TSC (1 << 8)
+
+#ifndef __ASM__
+
+struct cpuid_regs {
+	uint32_t eax;
+	uint32_t ebx;
+	uint32_t ecx;
+	uint32_t edx;
+};
+
+void cpuid(uint32_t leaf, uint32_t subleaf, struct cpuid_regs *regs);
+
+#endif /* __ASM__ */
+#endif /* _CPUID_H_ */
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _FPU_H_
+#define _FPU_H_
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+#define CR4_OSXSAVE (1 << 18)
+
+#define XCR0_X87 (1 << 0)
+#define XCR0_SSE (1 << 1)
+#define XCR0_AVX (1 << 2)
+
+#ifndef __ASM__
+
+#include <kernel/common.h>
+
+struct proc;
+
+void fpu_init();
+void fpu_init_cpu();
+void fpu_switch(struct proc *prev, struct proc *next);
+bool fpu_trap();
+void fpu_fork(struct proc *parent, struct proc *child);
+void fpu_free(struct proc *proc);
+
+/* The kernel is built without SSE, code that wants the vector registers must
+ * run between these two, with interrupts disabled
+ */
+uint64_t kernel_fpu_begin();
+void kernel_fpu_end(uint64_t flags);
+
+#endif /* __ASM__ */
+#endif /* _FPU_H_ */
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _KMSG_H_
+#define _KMSG_H_
+
+#include <kernel/common.h>
+
+#define KMSG_RING_SIZE 0x4000 /* per CPU, power of two */
+#define KMSG_LOG_SIZE 0x10000 /* console text kept for /dev/kmsg, power of two */
+#define KMSG_TEXT_MAX 1024
+
+/* a message in the ring of the CPU that logged it, followed by len bytes of
+ * text and padded to 8 bytes
+ */
+struct kmsg_hdr {
+	uint64_t seq;
+	uint64_t ts; /* clock_ns when it was logged */
+	uint16_t len;
+	uint8_t cpu;
+	uint8_t pad[5];
+};
+
+struct devfs_dev_info;
+extern struct devfs_dev_info kmsg_dev_info;
+
+void kmsg_init_cpu();
+void kmsg_init();
+void kmsg_store(const char *text, size_t len);
+void kmsg_kick();
+void kmsg_panic();
+
+#endif /* _KMSG_H_ */
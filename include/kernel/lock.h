@@ -2,14 +2,58 @@
 #ifndef _LOCK_H_
 #define _LOCK_H_
 
-typedef int spinlock_t;
-typedef spinlock_t mtx_t;
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Ticket lock: the low half is the ticket being served, the high half the
+ * next ticket to hand out. Waiters are served in the order they arrived. A
+ * zeroed lock is unlocked.
+ */
+typedef uint32_t spinlock_t;
+
+/* MCS lock: a queue of waiters, each spinning on its own node so a contended
+ * lock doesn't bounce a single cache line between all of them. The node is
+ * provided by the caller, usually on its stack, and must be passed to the
+ * matching release. A NULL lock is unlocked.
+ */
+struct mcs_node {
+	struct mcs_node *volatile next;
+	volatile bool locked;
+};
+
+typedef struct mcs_node *mcs_lock_t;
+
+/* Reader-writer spinlock: the low bits count the readers, RWLOCK_WRITER is set
+ * while a writer holds it. A waiting writer sets RWLOCK_WAITING to hold back
+ * new readers, so it can't be starved. A zeroed lock is unlocked.
+ */
+typedef uint32_t rwlock_t;
+
+#define RWLOCK_WRITER 0x80000000
+#define RWLOCK_WAITING 0x40000000
+
+static inline void cpu_relax()
+{
+	__asm__ volatile("pause" ::: "memory");
+}
+
+uint64_t irq_save();
+void irq_restore(uint64_t flags);
 
-int atomic_cmpxchg(volatile int *ptr, int cmpval, int newval);
 void spinlock_acquire(spinlock_t *lock);
+bool spinlock_try_acquire(spinlock_t *lock);
 void spinlock_release(spinlock_t *lock);
 
-void mtx_acquire(mtx_t *mtx);
-void mtx_release(mtx_t *mtx);
+/* for locks also taken from interrupt handlers */
+uint64_t spinlock_acquire_irqsave(spinlock_t *lock);
+void spinlock_release_irqrestore(spinlock_t *lock, uint64_t flags);
+
+void read_lock(rwlock_t *lock);
+void read_unlock(rwlock_t *lock);
+void write_lock(rwlock_t *lock);
+void write_unlock(rwlock_t *lock);
+
+void mcs_acquire(mcs_lock_t *lock, struct mcs_node *node);
+void mcs_release(mcs_lock_t *lock, struct mcs_node *node);
 
 #endif /* _LOCK_H_ */
@@ -17,8 +17,20 @@
 #define PAGE_PWT 0x8
 #define PAGE_PCD 0x10
 
+#define PAGE_ADDR_MASK 0x000FFFFFFFFFF000
+
+/* non-leaf entries keep the number of present entries in the table they point
+ * to in the bits ignored by the processor
+ */
+#define PAGE_COUNT_SHIFT 52
+#define PAGE_COUNT_MASK 0x3FF0000000000000
+
 #define MAP_ANONYMOUS 0x20
 
+#define PF_BUDDY 0x01 /* first frame of a buddy allocation */
+#define PF_SLAB 0x02 /* backs a slab */
+#define PF_DMA 0x04 /* remapped uncached by kmalloc(ALLOC_DMA) */
+
 #ifndef __ASM__
 
 #define ALIGN(_a) __attribute__((aligned(_a)))
@@ -29,8 +41,10 @@
 
 genrw(rsp);
 genrw(rbp);
+genrw(cr0);
 genrw(cr2);
 genrw(cr3);
+genrw(cr4);
 genrw(ds);
 
 #undef genrw
@@ -77,6 +91,19 @@ struct mem_region {
 	bool usable;
 };
 
+struct _slab;
+
+/* per physical frame metadata, indexed by page frame number */
+struct page_frame {
+	uint32_t refcount;
+	uint16_t flags;
+	uint8_t order; /* log2 of the buddy allocation size in pages */
+	struct _slab *slab; /* owning slab for PF_SLAB frames */
+
+	struct page_frame *lru_next;
+	struct page_frame *lru_prev;
+};
+
 struct buddy_region_header {
 	paddr_t usable_base;
 	size_t usable_len;
@@ -102,6 +129,12 @@ extern size_t max_regions;
 extern struct rbtree *kmap_tree;
 extern spinlock_t kmap_lock;
 
+extern size_t buddy_total_pages;
+extern size_t buddy_free_pages;
+
+extern struct page_frame *page_frames;
+extern size_t num_page_frames;
+
 extern struct page *pml4;
 extern paddr_t kcr3;
 extern struct page kdefault_attrs;
@@ -109,6 +142,8 @@ extern struct page kdefault_attrs;
 void *buddy_alloc(size_t size);
 void buddy_free(void *paddr_hhdm);
 uintptr_t mmap_find_unmapped(struct rbtree *tree, spinlock_t *lock, uintptr_t start, size_t len);
+void tlb_flush_all();
+void tlb_note_reload();
 void kmap(paddr_t paddr, uintptr_t vaddr, size_t len, uint64_t attr);
 void *proc_mmap(struct proc *proc, paddr_t paddr, uintptr_t vaddr, size_t len, uint64_t attr);
 void *kmap_device(void *dev_paddr, size_t len);
@@ -119,6 +154,44 @@ void mem_early_init(char *mem, size_t len);
 uint64_t phys_read(paddr_t paddr);
 void phys_write(paddr_t paddr, uint64_t data);
 void *phys_memcpy(void *dest, paddr_t src, size_t num);
+void page_frames_set(void *ptr, size_t len, uint16_t flags, struct _slab *slab);
+
+static inline void invlpg(uintptr_t vaddr)
+{
+	__asm__ volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+}
+
+static inline struct page_frame *phys_to_frame(paddr_t paddr)
+{
+	size_t pfn = paddr >> 12;
+
+	if (pfn >= num_page_frames)
+		return NULL;
+
+	return &page_frames[pfn];
+}
+
+/* only valid for pointers into the HHDM */
+static inline struct page_frame *virt_to_frame(void *ptr)
+{
+	return phys_to_frame((uintptr_t)ptr & ~hhdm_start);
+}
+
+static inline paddr_t frame_to_phys(struct page_frame *frame)
+{
+	return (paddr_t)(frame - page_frames) << 12;
+}
+
+static inline void page_frame_get(struct page_frame *frame)
+{
+	__atomic_add_fetch(&frame->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/* returns the remaining number of references */
+static inline uint32_t page_frame_put(struct page_frame *frame)
+{
+	return __atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL);
+}
 
 #endif /* __ASM__ */
 #endif /* _MEM_H_ */
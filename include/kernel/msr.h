@@ -10,11 +10,15 @@
 #define MSR_IA32_STAR 0xC0000081
 #define MSR_IA32_LSTAR 0xC0000082
 #define MSR_IA32_FMASK 0xC0000084
+#define MSR_IA32_GS_BASE 0xC0000101
+#define MSR_IA32_KERNEL_GS_BASE 0xC0000102
+#define MSR_IA32_TSC_DEADLINE 0x6E0
 
 #ifndef __ASM__
 
 uint64_t rdmsr(uint32_t msr);
 void wrmsr(uint32_t msr, uint64_t val);
+uint64_t rdtsc();
 
 #endif /* __ASM__ */
 #endif /* _MSR_H_ */
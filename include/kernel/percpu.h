@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _PERCPU_H_
+#define _PERCPU_H_
+
+/* offsets into struct percpu for the entry code */
+#define PERCPU_SELF 0
+#define PERCPU_ID 8
+#define PERCPU_KSTACK 16
+#define PERCPU_CURR 24
+#define PERCPU_USER_RSP 32
+
+#ifndef __ASM__
+
+#include <kernel/common.h>
+
+struct proc;
+
+/* Data private to a CPU, reached through the GS base while in the kernel
+ *
+ * The entry code does a swapgs when coming from user mode and again on the
+ * way back, so user code never sees this.
+ */
+struct percpu {
+	struct percpu *self;
+	uint64_t id; /* LAPIC ID */
+	uintptr_t kstack; /* top of the stack of the CPU, also in its TSS */
+	struct proc *curr; /* running process, the idle process if none */
+	uintptr_t user_rsp; /* user stack pointer while gate_syscall switches stacks */
+	struct proc *fpu_owner; /* whose FPU state was last loaded in the registers */
+	uint64_t features; /* CPU_FEATURE_* mask from cpufeature_probe */
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+static inline struct percpu *this_cpu()
+{
+	struct percpu *cpu;
+	__asm__ volatile("movq %%gs:0, %0" : "=r"(cpu));
+	return cpu;
+}
+
+/* LAPIC ID of this CPU, without reading the LAPIC */
+static inline uint8_t cpu_id()
+{
+	uint64_t id;
+	__asm__ volatile("movq %%gs:%c1, %0" : "=r"(id) : "i"(PERCPU_ID));
+	return id;
+}
+
+static inline bool this_cpu_has(int feature)
+{
+	return this_cpu()->features & (1ull << feature);
+}
+
+void percpu_init(uintptr_t kstack);
+
+#endif /* __ASM__ */
+#endif /* _PERCPU_H_ */
@@ -8,6 +8,8 @@
 #include <kernel/lock.h>
 #include <kernel/rbtree.h>
 #include <kernel/slab.h>
+#include <kernel/rcu.h>
+#include <kernel/percpu.h>
 
 #include <lib/sem.h>
 
@@ -32,6 +34,7 @@
 #define PM_SLB 1
 
 typedef int64_t pid_t;
+typedef uint32_t uid_t;
 
 struct proc_mmap_entry {
 	uintptr_t vaddr;
@@ -73,7 +76,7 @@ struct proc_mapping {
 	size_t len;
 	uint64_t attr;
 	uint64_t type;
-	slab_t *slab;
+	struct kmem_cache *cache;
 	struct proc_mapping *next;
 };
 
@@ -85,24 +88,31 @@ struct proc_allocation {
 
 struct proc {
 	struct procregs regs;
+	struct procregs kregs; /* kernel context while asleep in a system call */
 	uint8_t state;
 	pid_t pid;
 	pid_t ppid;
+	uid_t uid; /* inherited on fork, 0 is root */
 	uint64_t cr3;
 	spinlock_t lock;
 
 	bool is_kernel;
+	bool in_kernel; /* in a system call, kregs is the live context */
 
 	struct rbtree page_map;
 	spinlock_t page_map_lock;
 
 	struct rbtree fd_map;
-	spinlock_t fd_map_lock;
+	rwlock_t fd_map_lock;
 
 	struct proc *parent;
 	struct rbtree children;
 
-	struct proc *buddy_proc;
+	uintptr_t kstack; /* KSTACK_SIZE bytes, system calls run on it */
+
+	/* extended FPU state, allocated on first use */
+	void *fpu_state;
+	int fpu_cpu; /* CPU it was last loaded on, or -1 */
 
 	uintptr_t stack_start;
 	uintptr_t stack_size;
@@ -110,22 +120,44 @@ struct proc {
 	uintptr_t heap_start;
 
 	struct rbtree umalloc_tree;
-};
+
+	/* PID hash chain, freed through rcu once the process is gone */
+	struct proc *pid_next;
+	struct rcu_head rcu;
+
+	/* run queue linkage, only valid while the state is PROC_STOPPED */
+	struct rbnode rq_node;
+	unsigned cpu; /* run queue the process is on or was last scheduled from */
+	volatile bool on_cpu; /* picked to run, until its CPU is off its stacks */
+
+	/* fair scheduling, all times in nanoseconds */
+	int nice;
+	uint32_t weight;
+	uint64_t vruntime;
+	uint64_t exec_start; /* last time the vruntime was brought up to date */
+	uint64_t slice_start; /* when the process was last picked to run */
+	uint64_t last_run; /* when the process last stopped running */
+} ALIGN(CACHELINE_SIZE); /* keep procs on different CPUs off each other's cache lines */
 
 struct procregs *proc_current_regs();
 struct proc *proc_create();
 struct proc *proc_createv(int flags);
+struct proc *proc_create_kthread(void (*entry)());
 void proc_init_memory(struct proc *proc, uint64_t mem_flags);
 void proc_init_page_tables(struct proc *proc);
 struct proc *proc_fork(struct proc *parent);
 struct proc *proc_get(pid_t pid);
 pid_t getpid();
 pid_t getupid();
+uid_t getuid();
 void proc_term(pid_t pid);
+void proc_exit();
 struct proc *proc_find(pid_t pid);
 void proc_save_state();
-void proc_set_current(pid_t pid);
+void proc_set_current(struct proc *proc);
 void proc_init(unsigned num_cpus);
+void proc_init_cpu();
+unsigned proc_cpus(const uint8_t **ids);
 void trap_sched();
 void schedule();
 void syscall_block();
@@ -133,7 +165,16 @@ void proc_set_exec_addr(struct proc *proc, uintptr_t addr);
 void proc_set_flags(struct proc *proc, uint64_t flags);
 void proc_set_stack(struct proc *proc, uintptr_t base, size_t size);
 void proc_set_state(pid_t pid, uint8_t state);
+void proc_set_nice(struct proc *proc, int nice);
+bool proc_need_resched();
+void proc_wake(struct proc *proc);
 
 void sswtch();
 
+/* the process running on this CPU, the idle process of the CPU if none */
+static inline struct proc *proc_current()
+{
+	return this_cpu()->curr;
+}
+
 #endif /* _PROC_H_ */
@@ -31,6 +31,8 @@ struct rbtree {
 
 struct rbnode *rbt_insert(struct rbtree *tree, uint64_t key);
 void rbt_delete(struct rbtree *tree, struct rbnode *del);
+void rbt_link(struct rbtree *tree, struct rbnode *node);
+void rbt_unlink(struct rbtree *tree, struct rbnode *node);
 void rbt_destroy(struct rbtree *tree);
 struct rbnode *rbt_search(struct rbtree *tree, uint64_t key);
 struct rbnode *rbt_successor(struct rbnode *node);
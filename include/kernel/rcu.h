@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _RCU_H_
+#define _RCU_H_
+
+#include <kernel/common.h>
+
+/* Read-copy-update
+ *
+ * Readers run between rcu_read_lock and rcu_read_unlock without taking any
+ * lock and must not sleep. Writers publish new versions with
+ * rcu_assign_pointer and free old ones only after a grace period, once every
+ * CPU has been seen outside of a read section.
+ */
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void rcu_read_lock();
+void rcu_read_unlock();
+
+void rcu_note_qs();
+void synchronize_rcu();
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void kfree_rcu(void *ptr);
+
+void rcu_init_cpu();
+void rcu_init();
+
+#endif /* _RCU_H_ */
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _RECLAIM_H_
+#define _RECLAIM_H_
+
+#include <kernel/common.h>
+
+/* A cache that can give memory back under pressure
+ *
+ * count returns the number of objects that could currently be released, scan
+ * releases up to nr of them and returns how many were released. scan may be
+ * called from inside buddy_alloc, so it must not allocate and must not block
+ * on a lock that an allocating caller could be holding.
+ */
+struct shrinker {
+	const char *name;
+	size_t (*count)(void);
+	size_t (*scan)(size_t nr);
+
+	struct shrinker *next;
+};
+
+extern size_t reclaim_wmark_low;
+extern size_t reclaim_wmark_high;
+
+void shrinker_register(struct shrinker *shrinker);
+size_t reclaim_pages(size_t nr_pages);
+void reclaim_wakeup();
+void reclaim_init();
+
+#endif /* _RECLAIM_H_ */
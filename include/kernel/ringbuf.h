@@ -3,18 +3,45 @@
 #define _RINGBUF_H
 
 #include <kernel/common.h>
+#include <kernel/atomic.h>
+#include <kernel/wait.h>
 
+/* more than one context writes to the ring */
+#define RINGBUF_MP 0x01
+
+/* Lock-free byte ring
+ *
+ * head and tail run freely and are only masked to index buf, head - tail is
+ * the number of bytes in the ring. Without RINGBUF_MP only one context may
+ * write at a time, with it producers claim space by advancing reserve and
+ * publish it by advancing head in the order they claimed it. Any number of
+ * readers is fine, each claims what it copied out by advancing tail.
+ */
 typedef struct _ringbuf {
 	char *buf;
-	size_t size;
+	size_t size; /* power of two */
+	uint32_t flags;
+
 	size_t head;
 	size_t tail;
+	size_t reserve;
+
+	waitq_t readers;
+	waitq_t writers;
 } ringbuf_t;
 
-ringbuf_t *ringbuf_create(size_t size);
+ringbuf_t *ringbuf_create(size_t size, uint32_t flags);
 void ringbuf_destroy(ringbuf_t *rb);
 
 size_t ringbuf_write(ringbuf_t *rb, const char *buf, size_t count);
 size_t ringbuf_read(ringbuf_t *rb, char *buf, size_t count);
+size_t ringbuf_write_wait(ringbuf_t *rb, const char *buf, size_t count);
+size_t ringbuf_read_wait(ringbuf_t *rb, char *buf, size_t count);
+
+/* bytes that can be read right now */
+static inline size_t ringbuf_used(ringbuf_t *rb)
+{
+	return smp_load_acquire(&rb->head) - smp_load_acquire(&rb->tail);
+}
 
 #endif /* _RINGBUF_H */
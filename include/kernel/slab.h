@@ -8,6 +8,7 @@
 
 #define SLAB_PAGE_ALIGN 0x01
 #define SLAB_DMA_64K 0x02
+#define SLAB_HWCACHE_ALIGN 0x04
 
 #define ALLOC_KERN 0x01
 #define ALLOC_DMA 0x02
@@ -27,19 +28,40 @@
 	}
 
 typedef struct _slab {
-	size_t size; /* size of each object */
 	size_t tsize; /* total size of this slab */
 	size_t num; /* number of objects in this slab */
 	size_t free; /* number of free objects */
-	uint64_t flags;
-	size_t align;
+	size_t colour; /* offset of the first object past the header */
 	uintptr_t *nextfree;
 	struct _slab *next;
 	struct _slab *prev;
-
-	spinlock_t lock;
+	struct kmem_cache *cache; /* owning cache */
 } slab_t;
 
+struct kmem_cache {
+	const char *name;
+	size_t obj_size; /* size requested at creation */
+	size_t size; /* size of each object including alignment padding */
+	size_t align;
+	size_t slab_size; /* size of each slab in the chain */
+	uint64_t flags;
+	void (*ctor)(void *obj);
+
+	size_t colour_next;
+	size_t colour_max;
+
+	/* statistics */
+	size_t allocs;
+	size_t frees;
+	size_t active;
+	size_t num_slabs;
+
+	slab_t *slabs;
+	mcs_lock_t lock;
+
+	struct kmem_cache *next;
+};
+
 struct kmap_entry {
 	uintptr_t *ptr;
 	size_t size;
@@ -47,9 +69,12 @@ struct kmap_entry {
 	struct kmap_entry *next;
 };
 
-slab_t *slab_create(size_t size, size_t cache_size, uint64_t flags);
-void *slab_alloc(slab_t *slab);
-void slab_free(slab_t *slab, void *ptr);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, uint64_t flags, void (*ctor)(void *));
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *ptr);
+
+struct devfs_dev_info;
+extern struct devfs_dev_info slabinfo_dev_info;
 
 void kmalloc_init();
 void *kmalloc(size_t size, uint64_t flags);
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _STATIC_KEY_H_
+#define _STATIC_KEY_H_
+
+#include <kernel/common.h>
+
+/* Static keys
+ *
+ * A branch on a key that is off is a 5 byte NOP that falls through, turning
+ * the key on rewrites it into a jmp to the code behind the branch. Switching
+ * is slow and stops every other CPU, testing is free.
+ */
+struct static_key {
+	uint32_t enabled;
+};
+
+#define STATIC_KEY_INIT { 0 }
+
+/* an entry of .jump_table, one per branch */
+struct jump_entry {
+	uint8_t *code;
+	uint8_t *target;
+	struct static_key *key;
+};
+
+/* true if the key is on, _key must be a constant address */
+#define static_branch_unlikely(_key)                                         \
+	({                                                                   \
+		__label__ l_yes, l_out;                                      \
+		bool __ret = false;                                          \
+		__asm__ goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"    \
+			     ".pushsection .jump_table, \"a\"\n\t"           \
+			     ".balign 8\n\t"                                 \
+			     ".quad 1b, %l[l_yes], %c0\n\t"                  \
+			     ".popsection"                                   \
+			     :                                               \
+			     : "i"(_key)                                     \
+			     :                                               \
+			     : l_yes);                                       \
+		goto l_out;                                                  \
+	l_yes:                                                               \
+		__ret = true;                                                \
+	l_out:                                                               \
+		__ret;                                                       \
+	})
+
+void static_key_init();
+int static_key_enable(struct static_key *key);
+void static_key_disable(struct static_key *key);
+
+static inline bool static_key_enabled(struct static_key *key)
+{
+	return __atomic_load_n(&key->enabled, __ATOMIC_RELAXED);
+}
+
+#endif /* _STATIC_KEY_H_ */
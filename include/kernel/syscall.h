@@ -5,17 +5,25 @@
 #define SYS_READ 0
 #define SYS_WRITE 1
 #define SYS_OPEN 2
+#define SYS_CLOSE 3
 #define SYS_MMAP 9
 #define SYS_MUNMAP 11
+#define SYS_PIPE 22
 #define SYS_FORK 57
 #define SYS_EXIT 60
 #define SYS_MKDIR 83
 #define SYS_MKNOD 133
+#define SYS_GETPRIORITY 140
+#define SYS_SETPRIORITY 141
 #define SYS_LSDIR 254
 
+#define PRIO_PROCESS 0
+
 #include <kernel/common.h>
 #include <kernel/proc.h>
 
+void syscall_init();
+void syscall_init_cpu();
 void sys_set_return(struct proc *proc, uint64_t ret);
 void sswtch(); /* save and switch */
 
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <kernel/common.h>
+#include <kernel/static_key.h>
+
+#define TRACE_RING_EVENTS 4096 /* per CPU, power of two */
+
+/* event ids, and what the two arguments of each are */
+#define TRACE_LOST 0 /* events overwritten before they were read, count */
+#define TRACE_SYSCALL_ENTER 1 /* number, first argument */
+#define TRACE_SYSCALL_EXIT 2 /* number, return value */
+#define TRACE_SCHED_SWITCH 3 /* previous pid, next pid, 0 for idle */
+#define TRACE_BLOCK_READ 4 /* offset, size */
+#define TRACE_BLOCK_WRITE 5 /* offset, size */
+#define TRACE_BLOCK_DONE 6 /* return value, size */
+#define TRACE_BUDDY_ALLOC 7 /* size, address */
+#define TRACE_SLAB_ALLOC 8 /* object size, address */
+#define TRACE_PAGE_FAULT 9 /* address, error code */
+#define TRACE_NUM_EVENTS 10
+
+/* an event as read from /dev/trace */
+struct trace_event {
+	uint64_t tsc;
+	uint16_t id;
+	uint8_t cpu;
+	uint8_t pad;
+	uint32_t pid;
+	uint64_t args[2];
+};
+
+struct devfs_dev_info;
+extern struct devfs_dev_info trace_dev_info;
+
+extern struct static_key trace_keys[TRACE_NUM_EVENTS];
+
+void trace_event(uint16_t id, uint64_t arg0, uint64_t arg1);
+
+/* Record an event if it is enabled. The arguments are only evaluated then,
+ * a disabled tracepoint costs a NOP.
+ */
+#define trace(_id, _arg0, _arg1)                                                  \
+	do {                                                                      \
+		if (static_branch_unlikely(&trace_keys[_id]))                     \
+			trace_event((_id), (uint64_t)(_arg0), (uint64_t)(_arg1)); \
+	} while (0)
+
+#endif /* _TRACE_H_ */
@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#ifndef _WAIT_H_
+#define _WAIT_H_
+
+#include <stdbool.h>
+
+#include <kernel/lock.h>
+
+struct proc;
+
+/* A process waiting on a wait queue, lives on the stack of the waiter */
+struct waitq_entry {
+	struct proc *proc;
+	volatile bool woken;
+	bool queued;
+
+	struct waitq_entry *next;
+};
+
+/* FIFO of blocked processes waiting for a condition */
+typedef struct {
+	spinlock_t lock;
+	struct waitq_entry *head;
+	struct waitq_entry *tail;
+} waitq_t;
+
+/* sleeping lock, waiters are blocked instead of spinning */
+typedef struct {
+	spinlock_t locked;
+	waitq_t wq;
+} mtx_t;
+
+void waitq_init(waitq_t *wq);
+void waitq_prepare(waitq_t *wq, struct waitq_entry *entry);
+void waitq_finish(waitq_t *wq, struct waitq_entry *entry);
+void waitq_sleep(struct waitq_entry *entry);
+void waitq_wake_one(waitq_t *wq);
+void waitq_wake_all(waitq_t *wq);
+
+/* Block the current process until cond is true
+ *
+ * The process is queued before cond is checked, so a wakeup that happens
+ * between the check and going to sleep is not lost. The kernel context of a
+ * CPU can't block and polls cond instead.
+ */
+#define wait_event(wq, cond)                                   \
+	do {                                                   \
+		struct waitq_entry __entry;                    \
+		__entry.queued = false;                        \
+		while (1) {                                    \
+			waitq_prepare((wq), &__entry);         \
+			if (cond)                              \
+				break;                         \
+			waitq_sleep(&__entry);                 \
+		}                                              \
+		waitq_finish((wq), &__entry);                  \
+	} while (0)
+
+void mtx_init(mtx_t *mtx);
+void mtx_acquire(mtx_t *mtx);
+void mtx_release(mtx_t *mtx);
+
+#endif /* _WAIT_H_ */
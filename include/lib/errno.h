@@ -17,6 +17,10 @@
 #define EBUSY 12
 #define ENOSYS 13
 #define ESYSCALLBLK 14
+#define ESRCH 15
+#define ENODEV 16
+#define EPIPE 17
+#define EPERM 18
 
 #ifndef __ASM__
 
@@ -2,17 +2,19 @@
 #ifndef _SEM_H_
 #define _SEM_H_
 
-#include <kernel/lock.h>
+#include <kernel/wait.h>
 
 typedef struct {
 	int count;
 	spinlock_t lock;
+	waitq_t wq;
 } sem_t;
 
 sem_t *sem_create(int count);
 void sem_destroy(sem_t *sem);
 
 int sem_trywait(sem_t *sem);
+void sem_wait(sem_t *sem);
 void sem_post(sem_t *sem);
 
 #endif /* _SEM_H_ */
@@ -22,6 +22,15 @@ bool strempty(const char *s);
 char **strsplit(const char *str, char delim, int *num);
 size_t strlen(const char *c);
 int atoi(const char *a);
+void string_init();
+
+/* lib/memcpy.S, memcpy and memset use the best of these */
+void *memcpy_generic(void *dest, const void *src, size_t num);
+void *memcpy_erms(void *dest, const void *src, size_t num);
+void *memcpy_movsq(void *dest, const void *src, size_t num);
+void *memcpy_sse(void *dest, const void *src, size_t num);
+void *memset_erms(void *str, int c, size_t n);
+void *memset_stosq(void *str, int c, size_t n);
 
 extern spinlock_t strtok_lock;
 
@@ -5,7 +5,7 @@
 
 #include <limine/limine.h>
 
-struct limine_rsdp_request rsdp_req = { .id = LIMINE_RSDP_REQUEST, .revision = 0 };
+volatile struct limine_rsdp_request rsdp_req = { .id = LIMINE_RSDP_REQUEST, .revision = 0 };
 
 static struct rsdp *rsdp = NULL;
 struct madt *__madt = NULL;
@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <kernel/common.h>
+#include <kernel/cpufeature.h>
+#include <kernel/cpuid.h>
+#include <kernel/mem.h>
+
+#define CR0_WP (1 << 16)
+
+#define OPCODE_CALL 0xE8
+#define OPCODE_JMP 0xE9
+#define OPCODE_NOP 0x90
+
+extern struct alt_instr __alt_instructions[];
+extern struct alt_instr __alt_instructions_end[];
+
+uint64_t boot_cpu_features = 0;
+
+static const char *cpufeature_names[] = {
+	[CPU_FEATURE_FXSR] = "fxsr",
+	[CPU_FEATURE_XSAVE] = "xsave",
+	[CPU_FEATURE_XSAVEOPT] = "xsaveopt",
+	[CPU_FEATURE_AVX] = "avx",
+	[CPU_FEATURE_ERMS] = "erms",
+	[CPU_FEATURE_PCID] = "pcid",
+	[CPU_FEATURE_INVPCID] = "invpcid",
+	[CPU_FEATURE_FSGSBASE] = "fsgsbase",
+	[CPU_FEATURE_X2APIC] = "x2apic",
+	[CPU_FEATURE_TSC_DEADLINE] = "tsc_deadline",
+	[CPU_FEATURE_INVARIANT_TSC] = "invariant_tsc",
+	[CPU_FEATURE_PDPE1GB] = "pdpe1gb",
+};
+
+#define SET_IF(_mask, _reg, _bit, _feature)    \
+	do {                                   \
+		if ((_reg) & (_bit))           \
+			(_mask) |= 1ull << (_feature); \
+	} while (0)
+
+/* feature mask of the CPU this runs on */
+uint64_t cpufeature_probe()
+{
+	struct cpuid_regs regs;
+	uint64_t mask = 0;
+
+	cpuid(CPUID_LEAF_MAX, 0, &regs);
+	uint32_t max = regs.eax;
+
+	cpuid(CPUID_LEAF_FEATURES, 0, &regs);
+	SET_IF(mask, regs.edx, CPUID_FEAT_EDX_FXSR, CPU_FEATURE_FXSR);
+	SET_IF(mask, regs.ecx, CPUID_FEAT_ECX_XSAVE, CPU_FEATURE_XSAVE);
+	SET_IF(mask, regs.ecx, CPUID_FEAT_ECX_AVX, CPU_FEATURE_AVX);
+	SET_IF(mask, regs.ecx, CPUID_FEAT_ECX_PCID, CPU_FEATURE_PCID);
+	SET_IF(mask, regs.ecx, CPUID_FEAT_ECX_X2APIC, CPU_FEATURE_X2APIC);
+	SET_IF(mask, regs.ecx, CPUID_FEAT_ECX_TSC_DEADLINE, CPU_FEATURE_TSC_DEADLINE);
+
+	if (max >= CPUID_LEAF_EXT_FEATURES) {
+		cpuid(CPUID_LEAF_EXT_FEATURES, 0, &regs);
+		SET_IF(mask, regs.ebx, CPUID_EXTFEAT_EBX_FSGSBASE, CPU_FEATURE_FSGSBASE);
+		SET_IF(mask, regs.ebx, CPUID_EXTFEAT_EBX_ERMS, CPU_FEATURE_ERMS);
+		SET_IF(mask, regs.ebx, CPUID_EXTFEAT_EBX_INVPCID, CPU_FEATURE_INVPCID);
+	}
+
+	if (max >= CPUID_LEAF_XSTATE && (mask & (1ull << CPU_FEATURE_XSAVE))) {
+		cpuid(CPUID_LEAF_XSTATE, 1, &regs);
+		SET_IF(mask, regs.eax, CPUID_XSTATE_EAX_XSAVEOPT, CPU_FEATURE_XSAVEOPT);
+	}
+
+	cpuid(CPUID_LEAF_EXT_MAX, 0, &regs);
+	uint32_t ext_max = regs.eax;
+
+	if (ext_max >= CPUID_LEAF_EXT_INFO) {
+		cpuid(CPUID_LEAF_EXT_INFO, 0, &regs);
+		SET_IF(mask, regs.edx, CPUID_EXTINFO_EDX_PDPE1GB, CPU_FEATURE_PDPE1GB);
+	}
+
+	if (ext_max >= CPUID_LEAF_APM) {
+		cpuid(CPUID_LEAF_APM, 0, &regs);
+		SET_IF(mask, regs.edx, CPUID_APM_EDX_INVARIANT_TSC, CPU_FEATURE_INVARIANT_TSC);
+	}
+
+	return mask;
+}
+
+/* probe the BSP, before anything asks boot_cpu_has */
+void cpufeature_init()
+{
+	boot_cpu_features = cpufeature_probe();
+
+	kprintf(LOG_INFO "CPU features:");
+	for (size_t i = 0; i < ARRAY_SIZE(cpufeature_names); i++) {
+		if (boot_cpu_has(i))
+			kprintf(" %s", cpufeature_names[i]);
+	}
+	kprintf("\n");
+}
+
+/* byte by byte, memcpy and memset are among the sites being patched */
+static void text_copy(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		((volatile uint8_t *)dst)[i] = src[i];
+}
+
+/* Overwrite len bytes of kernel text at dst
+ *
+ * Write protection is lifted in case the text is mapped read-only. Writing
+ * CR0 is serializing, which also discards anything this CPU already fetched
+ * from the old bytes. Other CPUs must not be running them meanwhile.
+ */
+void text_poke(void *dst, const void *src, size_t len)
+{
+	uint64_t flags = irq_save();
+	uint64_t cr0 = cr0_read();
+	cr0_write(cr0 & ~CR0_WP);
+
+	text_copy(dst, src, len);
+
+	cr0_write(cr0);
+	irq_restore(flags);
+}
+
+/* Patch every ALTERNATIVE whose feature the BSP has
+ *
+ * Runs once, before the APs are started, so no other CPU can be executing the
+ * code being rewritten.
+ */
+void alternatives_apply()
+{
+	int patched = 0;
+
+	for (struct alt_instr *a = __alt_instructions; a < __alt_instructions_end; a++) {
+		if (!boot_cpu_has(a->feature))
+			continue;
+
+		assert(a->repl_len <= a->orig_len);
+
+		uint8_t insn[a->orig_len];
+		text_copy(insn, a->repl, a->repl_len);
+		for (size_t i = a->repl_len; i < a->orig_len; i++)
+			insn[i] = OPCODE_NOP;
+
+		/* relative to where it ends up, not where it was assembled */
+		if (a->repl_len == 5 && (insn[0] == OPCODE_JMP || insn[0] == OPCODE_CALL)) {
+			int32_t rel = *(int32_t *)(insn + 1);
+			rel += a->repl - a->orig;
+			*(int32_t *)(insn + 1) = rel;
+		}
+
+		text_poke(a->orig, insn, a->orig_len);
+		patched++;
+	}
+
+#ifdef KDEBUG
+	kprintf(LOG_DEBUG "alternatives: patched %d of %d sites\n", patched, (int)(__alt_instructions_end - __alt_instructions));
+#else
+	(void)patched;
+#endif
+}
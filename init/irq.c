@@ -3,6 +3,7 @@
 #include <kernel/gdt.h>
 #include <kernel/idt.h>
 #include <kernel/irq.h>
+#include <kernel/proc.h>
 #include <dev/pic.h>
 #include <dev/serial.h>
 
@@ -116,6 +117,10 @@ void irq(int irq)
 		void (*handler)() = irq_handlers[irq];
 		handler();
 	}
+
+	/* a process woke up that should run before the interrupted one */
+	if (proc_need_resched())
+		schedule();
 }
 
 void idt_init()
@@ -11,6 +11,15 @@
 #include <kernel/proc.h>
 #include <kernel/trap.h>
 #include <kernel/elf.h>
+#include <kernel/reclaim.h>
+#include <kernel/rcu.h>
+#include <kernel/syscall.h>
+#include <kernel/percpu.h>
+#include <kernel/msr.h>
+#include <kernel/fpu.h>
+#include <kernel/cpufeature.h>
+#include <kernel/kmsg.h>
+#include <kernel/static_key.h>
 
 #include <dev/pic.h>
 #include <dev/serial.h>
@@ -27,9 +36,9 @@
 #define LIMINE_INTERNAL_MODULE_REQUIRED (1 << 0)
 #include <limine/limine.h>
 
-struct limine_hhdm_request hhdm_req = { .id = LIMINE_HHDM_REQUEST, .revision = 0 };
-struct limine_kernel_file_request module_req = { .id = LIMINE_KERNEL_FILE_REQUEST, .revision = 0 };
-struct limine_smp_request smp_req = { .id = LIMINE_SMP_REQUEST, .revision = 0 };
+volatile struct limine_hhdm_request hhdm_req = { .id = LIMINE_HHDM_REQUEST, .revision = 0 };
+volatile struct limine_kernel_file_request module_req = { .id = LIMINE_KERNEL_FILE_REQUEST, .revision = 0 };
+volatile struct limine_smp_request smp_req = { .id = LIMINE_SMP_REQUEST, .revision = 0 };
 
 static char *kcmdline;
 static char *kpath;
@@ -49,6 +58,9 @@ void load_stack_and_jump(uintptr_t rsp, uintptr_t rbp, void *func, void *arg);
 
 uintptr_t kstacks[256] = { 0 };
 
+/* set once the scheduler tick handler is installed */
+static volatile bool sched_started = false;
+
 static void do_dummy_proc()
 {
 	sti();
@@ -67,19 +79,99 @@ static inline void kexec(char *cmd)
 
 	kprintf("Loaded %s as PID %d\n", cmd, pid);
 
+	rcu_read_lock();
 	struct proc *proc = proc_get(pid);
+	rcu_read_unlock();
+
 	if (!proc) {
 		kprintf("Failed to get proc %d\n", pid);
 		return;
 	}
 
-	void _return_to_user(struct procregs * regs, paddr_t cr3);
-	proc_set_current(pid);
-	_return_to_user(&proc->regs, proc->cr3);
+	proc_set_state(pid, PROC_STOPPED);
+	schedule();
+}
+
+#ifdef KBENCH
+#define KBENCH_ITERATIONS 100000
+
+/* Cycles for a round trip through the interrupt entry and exit code. Vector
+ * 0x2F is never mapped, so this is save_context, irq() and restore_context
+ */
+static void kbench_trap()
+{
+	uint64_t start = rdtsc();
+
+	for (int i = 0; i < KBENCH_ITERATIONS; i++)
+		__asm__ volatile("int $0x2F" ::: "memory");
+
+	uint64_t cycles = rdtsc() - start;
+
+	kprintf(LOG_INFO "kbench: trap entry/exit: %d cycles\n", (int)(cycles / KBENCH_ITERATIONS));
+}
+
+#define KBENCH_COPY_SIZE 0x10000
+#define KBENCH_COPY_ROUNDS 64
+
+static void kbench_copy_report(const char *name, uint64_t cycles)
+{
+	uint64_t bytes = (uint64_t)KBENCH_COPY_SIZE * KBENCH_COPY_ROUNDS;
+
+	/* cycles per KiB, lower is better */
+	kprintf(LOG_INFO "kbench: %s: %d cycles/KiB\n", name, (int)(cycles * 1024 / bytes));
+}
+
+/* Throughput of the memcpy variants on a 64 KiB copy, against a byte loop */
+static void kbench_memcpy()
+{
+	char *src = kmalloc(KBENCH_COPY_SIZE, ALLOC_KERN);
+	char *dst = kmalloc(KBENCH_COPY_SIZE, ALLOC_KERN);
+	if (!src || !dst)
+		return;
+
+	memset(src, 0xA5, KBENCH_COPY_SIZE);
+
+	uint64_t start = rdtsc();
+	for (int r = 0; r < KBENCH_COPY_ROUNDS; r++) {
+		volatile char *d = dst;
+		for (size_t i = 0; i < KBENCH_COPY_SIZE; i++)
+			d[i] = src[i];
+	}
+	kbench_copy_report("byte loop", rdtsc() - start);
+
+	start = rdtsc();
+	for (int r = 0; r < KBENCH_COPY_ROUNDS; r++)
+		memcpy_movsq(dst, src, KBENCH_COPY_SIZE);
+	kbench_copy_report("rep movsq", rdtsc() - start);
+
+	start = rdtsc();
+	for (int r = 0; r < KBENCH_COPY_ROUNDS; r++)
+		memcpy_erms(dst, src, KBENCH_COPY_SIZE);
+	kbench_copy_report("rep movsb", rdtsc() - start);
+
+	start = rdtsc();
+	for (int r = 0; r < KBENCH_COPY_ROUNDS; r++) {
+		uint64_t flags = kernel_fpu_begin();
+		memcpy_sse(dst, src, KBENCH_COPY_SIZE);
+		kernel_fpu_end(flags);
+	}
+	kbench_copy_report("sse", rdtsc() - start);
+
+	start = rdtsc();
+	for (int r = 0; r < KBENCH_COPY_ROUNDS; r++)
+		memcpy(dst, src, KBENCH_COPY_SIZE);
+	kbench_copy_report("memcpy", rdtsc() - start);
+
+	kfree(src);
+	kfree(dst);
 }
+#endif /* KBENCH */
 
 void panic()
 {
+	/* interrupts may never drain the output again */
+	serial_sync();
+	kmsg_panic();
 	kprintf(LOG_ERROR "KERNEL PANIC\n");
 	cli();
 	while (1)
@@ -143,6 +235,9 @@ void kmain()
 	gdt_init();
 	idt_init();
 
+	cpufeature_init();
+	alternatives_apply();
+
 	struct limine_kernel_file_response *resp = module_req.response;
 
 	struct limine_file *kfile = (struct limine_file *)((paddr_t)resp->kernel_file | hhdm_start);
@@ -178,10 +273,14 @@ void kmain()
 	pic_init();
 	apic_init();
 
+	kstacks[lapic_idno()] = ptr;
+	percpu_init(ptr);
+	fpu_init();
+	string_init();
+
 	/* init the application processors */
 	struct limine_smp_response *smp_resp = smp_req.response;
 	proc_init(smp_resp->cpu_count);
-	void syscall_init();
 	syscall_init();
 
 	ahci_init();
@@ -220,21 +319,40 @@ void kmain()
 	exception_init();
 	serial_init();
 	irq_map(0, trap_sched);
+	proc_init_cpu();
+#ifdef KBENCH
+	kbench_trap();
+	kbench_memcpy();
+#endif
 	apic_enable_timer();
+	sched_started = true;
 
-	struct proc *dummy_proc = proc_createv(PT_KERN);
-	proc_init_memory(dummy_proc, 0);
-	proc_set_flags(dummy_proc, 0x46);
-	proc_set_exec_addr(dummy_proc, (uintptr_t)do_dummy_proc);
-	proc_set_state(dummy_proc->pid, PROC_ALLOWSCHED);
+	proc_create_kthread(do_dummy_proc);
+	reclaim_init();
+	rcu_init();
+	kmsg_init();
+	static_key_init();
 
 	load_stack_and_jump(ptr, ptr, kexec, "/bin/shtest.elf");
 }
 
+/* the application processors enter the scheduler once the BSP has installed
+ * the timer handler, and sit in its idle loop until there is work for them
+ */
+static void ap_idle()
+{
+	while (!sched_started)
+		(void)0;
+
+	proc_init_cpu();
+	apic_enable_timer();
+	schedule();
+}
+
 /* kmain for application processors
  *
- * This code enables basic processor functions and parks the processor, waiting
- * for future scheduling
+ * This code enables basic processor functions and parks the processor in its
+ * idle loop
  */
 void ap_kmain(struct limine_smp_info *info)
 {
@@ -245,10 +363,17 @@ void ap_kmain(struct limine_smp_info *info)
 	/* enable the APIC */
 	lapic_enable();
 
+	/* kprintf, and anything the allocator calls, finds this CPU through the
+	 * GS base, so it is set before the first allocation
+	 */
+	percpu_init(0);
+
 	void *kstack = buddy_alloc(KSTACK_SIZE);
 	uintptr_t ptr = (uintptr_t)kstack + KSTACK_SIZE - 8;
 
 	kstacks[info->lapic_id] = (uintptr_t)ptr;
+	this_cpu()->kstack = ptr;
+	fpu_init_cpu();
 
 	/* insert the TSS for each processor into the GDT */
 #ifdef KDEBUG
@@ -257,8 +382,10 @@ void ap_kmain(struct limine_smp_info *info)
 	uint16_t tss = gdt_insert_tss(ptr);
 	ltr(tss);
 
+	syscall_init_cpu();
+
 	sem_t *init_sem = (sem_t *)info->extra_argument;
 	sem_post(init_sem);
 
-	load_stack_and_jump(ptr, ptr, yield, NULL);
+	load_stack_and_jump(ptr, ptr, ap_idle, NULL);
 }
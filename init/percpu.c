@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <kernel/common.h>
+#include <kernel/percpu.h>
+#include <kernel/cpufeature.h>
+#include <kernel/kmsg.h>
+#include <kernel/msr.h>
+
+#include <dev/apic.h>
+
+_Static_assert(offsetof(struct percpu, self) == PERCPU_SELF, "PERCPU_SELF");
+_Static_assert(offsetof(struct percpu, id) == PERCPU_ID, "PERCPU_ID");
+_Static_assert(offsetof(struct percpu, kstack) == PERCPU_KSTACK, "PERCPU_KSTACK");
+_Static_assert(offsetof(struct percpu, curr) == PERCPU_CURR, "PERCPU_CURR");
+_Static_assert(offsetof(struct percpu, user_rsp) == PERCPU_USER_RSP, "PERCPU_USER_RSP");
+
+static struct percpu percpu_area[256];
+
+/* Point the GS base of this CPU at its data, the LAPIC must be enabled. kstack
+ * can be 0 and filled in later, as long as nothing enters from user mode yet.
+ *
+ * The user GS base, swapped in on the way to user mode, starts out as 0.
+ */
+void percpu_init(uintptr_t kstack)
+{
+	uint8_t id = lapic_idno();
+	struct percpu *cpu = &percpu_area[id];
+
+	cpu->self = cpu;
+	cpu->id = id;
+	cpu->kstack = kstack;
+	cpu->curr = NULL;
+	cpu->features = cpufeature_probe();
+
+	wrmsr(MSR_IA32_GS_BASE, (uint64_t)cpu);
+	wrmsr(MSR_IA32_KERNEL_GS_BASE, 0);
+
+	/* kprintf finds the log ring of the CPU through the GS base */
+	kmsg_init_cpu();
+
+	if (cpu->features != boot_cpu_features)
+		kprintf(LOG_WARN "CPU %d: features %X differ from the BSP's %X\n", (int)id, cpu->features, boot_cpu_features);
+}
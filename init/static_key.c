@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <kernel/common.h>
+#include <kernel/atomic.h>
+#include <kernel/cpufeature.h>
+#include <kernel/irq.h>
+#include <kernel/lock.h>
+#include <kernel/percpu.h>
+#include <kernel/proc.h>
+#include <kernel/static_key.h>
+#include <kernel/wait.h>
+
+#include <dev/apic.h>
+
+#define OPCODE_JMP 0xE9
+
+extern struct jump_entry __jump_table[];
+extern struct jump_entry __jump_table_end[];
+
+static const uint8_t jump_nop[5] = { 0x0F, 0x1F, 0x44, 0x00, 0x00 };
+
+/* serializes the switching of keys, which sleeps while other CPUs are stopped */
+static mtx_t static_key_mtx;
+
+static int stop_vector = -1;
+static uint32_t stop_arrived = 0;
+static volatile bool stop_release = false;
+
+/* Park this CPU until the patching is done. The iretq on the way back is
+ * serializing, so the interrupted code sees the new instructions.
+ */
+static void static_key_stop()
+{
+	lapic_eoi();
+
+	__atomic_add_fetch(&stop_arrived, 1, __ATOMIC_SEQ_CST);
+	while (!stop_release)
+		cpu_relax();
+}
+
+/* rewrite the branches on key with every other CPU parked in static_key_stop,
+ * none of them can be in the middle of an instruction that is changed
+ */
+static void static_key_patch(struct static_key *key, bool enable)
+{
+	const uint8_t *ids;
+	unsigned ncpus = proc_cpus(&ids);
+	uint8_t self = cpu_id();
+
+	uint64_t flags = irq_save();
+
+	stop_arrived = 0;
+	stop_release = false;
+	smp_mb();
+
+	for (unsigned i = 0; i < ncpus; i++) {
+		if (ids[i] != self)
+			lapic_send_ipi(ids[i], stop_vector);
+	}
+
+	while (__atomic_load_n(&stop_arrived, __ATOMIC_ACQUIRE) < ncpus - 1)
+		cpu_relax();
+
+	for (struct jump_entry *e = __jump_table; e < __jump_table_end; e++) {
+		if (e->key != key)
+			continue;
+
+		uint8_t insn[5];
+		if (enable) {
+			int32_t rel = e->target - (e->code + sizeof(insn));
+			insn[0] = OPCODE_JMP;
+			memcpy(insn + 1, &rel, sizeof(rel));
+		} else {
+			memcpy(insn, jump_nop, sizeof(insn));
+		}
+
+		text_poke(e->code, insn, sizeof(insn));
+	}
+
+	smp_store_release(&stop_release, true);
+	irq_restore(flags);
+}
+
+int static_key_enable(struct static_key *key)
+{
+	if (stop_vector < 0)
+		return -ENOSYS;
+
+	mtx_acquire(&static_key_mtx);
+	if (!key->enabled) {
+		static_key_patch(key, true);
+		__atomic_store_n(&key->enabled, 1, __ATOMIC_RELAXED);
+	}
+	mtx_release(&static_key_mtx);
+
+	return 0;
+}
+
+void static_key_disable(struct static_key *key)
+{
+	mtx_acquire(&static_key_mtx);
+	if (key->enabled) {
+		static_key_patch(key, false);
+		__atomic_store_n(&key->enabled, 0, __ATOMIC_RELAXED);
+	}
+	mtx_release(&static_key_mtx);
+}
+
+/* takes a free IRQ vector to stop the other CPUs with */
+void static_key_init()
+{
+	mtx_init(&static_key_mtx);
+
+	int irq = irq_highest_free();
+	if (irq < 0 || irq_map(irq, static_key_stop)) {
+		kprintf(LOG_ERROR "static_key: no free IRQ to stop CPUs with\n");
+		return;
+	}
+
+	stop_vector = 0x20 + irq;
+
+#ifdef KDEBUG
+	kprintf(LOG_DEBUG "static_key: %d branches, stopping CPUs with vector %x\n", (int)(__jump_table_end - __jump_table),
+		stop_vector);
+#endif
+}
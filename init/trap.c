@@ -2,9 +2,13 @@
 #include <kernel/common.h>
 #include <kernel/slab.h>
 #include <kernel/proc.h>
+#include <kernel/fpu.h>
+#include <kernel/trace.h>
 
-/* explicit handle list */
-void (*exception_handlers[32])(int error) = { NULL };
+/* explicit handle list, a handler returns true if the fault was handled and the
+ * faulting code can continue
+ */
+bool (*exception_handlers[32])(int error) = { NULL };
 
 static const char *exception_names[] = {
 	"Divide-by-zero Error",
@@ -40,33 +44,38 @@ static const char *exception_names[] = {
 	"Triple Fault",
 };
 
-static void exception_page_fault(int err)
+static bool exception_page_fault(int err)
 {
 	uint64_t cr2 = cr2_read();
 
+	trace(TRACE_PAGE_FAULT, cr2, err);
 	kprintf(LOG_ERROR "Page fault at %Xh, error code %xh\n", cr2, err);
+
+	return false;
 }
 
-void exception(int vector, int error)
+static bool exception_device_not_available(int err)
 {
-	pid_t pid = getpid();
+	return fpu_trap();
+}
 
-	kprintf("Process %d terminated: %s(%xh)\n", pid, exception_names[vector], error);
+void exception(int vector, int error)
+{
+	struct proc *proc = proc_current();
 
-	struct proc *proc = proc_find(pid);
+	if (exception_handlers[vector] && exception_handlers[vector](error))
+		return;
 
-	if (exception_handlers[vector])
-		exception_handlers[vector](error);
+	kprintf("Process %d terminated: %s(%xh)\n", proc->pid, exception_names[vector], error);
 
 	if(proc->pid == 0)
 		panic();
 
-	proc_set_current(0);
-	proc_term(pid);
-	schedule();
+	proc_exit();
 }
 
 void exception_init()
 {
+	exception_handlers[0x07] = exception_device_not_available;
 	exception_handlers[0x0E] = exception_page_fault;
 }
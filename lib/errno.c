@@ -17,6 +17,10 @@ static const char *errno_str[] = {
 	[EAGAIN] = "Try again",
 	[EBUSY] = "Device or resource busy",
 	[ENOSYS] = "Function not implemented",
+	[ESRCH] = "No such process",
+	[ENODEV] = "No such device",
+	[EPIPE] = "Broken pipe",
+	[EPERM] = "Operation not permitted",
 };
 
 inline const char *strerror(int errnum)
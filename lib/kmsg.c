@@ -0,0 +1,399 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <kernel/common.h>
+#include <kernel/atomic.h>
+#include <kernel/clock.h>
+#include <kernel/kmsg.h>
+#include <kernel/lock.h>
+#include <kernel/mem.h>
+#include <kernel/percpu.h>
+#include <kernel/proc.h>
+#include <kernel/wait.h>
+
+#include <dev/serial.h>
+#include <fs/devfs.h>
+
+/* Kernel log
+ *
+ * kprintf stores a message in the ring of its CPU with interrupts off, so only
+ * that CPU ever writes there, and never waits on anything. A message that
+ * doesn't fit is dropped and counted. The console side takes the messages out
+ * in sequence order across the rings, prints them and keeps the text in
+ * kmsg_log for /dev/kmsg. Whoever holds kmsg_console_lock does that: kmsgd
+ * once it runs, the caller of kprintf before that and after a panic.
+ */
+
+#define KMSG_NICE 19
+
+#define KMSG_REC_SIZE(_len) (sizeof(struct kmsg_hdr) + (((_len) + 7) & ~7ull))
+
+struct kmsg_ring {
+	char *buf;
+	uint64_t head; /* only written by the CPU that owns the ring */
+	uint64_t tail; /* only written by the console side */
+	uint64_t dropped;
+	uint64_t dropped_seen; /* dropped as of the last report */
+} ALIGN(CACHELINE_SIZE);
+
+static struct kmsg_ring kmsg_rings[256];
+static uint8_t kmsg_cpus[256];
+static unsigned kmsg_num_cpus = 0;
+
+static uint64_t kmsg_seq = 0;
+
+/* no CPU has a ring yet, messages are printed right away */
+static volatile bool kmsg_ready = false;
+/* kmsgd prints the messages, kprintf only tells it there are some */
+static volatile bool kmsg_deferred = false;
+static volatile bool kmsg_pending = false;
+static waitq_t kmsg_wq;
+
+/* console side state */
+static spinlock_t kmsg_console_lock = 0;
+static bool kmsg_line_start = true;
+static char kmsg_text[KMSG_TEXT_MAX];
+
+static char kmsg_log[KMSG_LOG_SIZE];
+static uint64_t kmsg_log_end = 0; /* bytes ever appended */
+static spinlock_t kmsg_log_lock = 0;
+
+static void kmsg_copy_in(struct kmsg_ring *r, uint64_t pos, const void *src, size_t n)
+{
+	size_t off = pos & (KMSG_RING_SIZE - 1);
+	size_t first = MIN(n, KMSG_RING_SIZE - off);
+
+	memcpy(r->buf + off, src, first);
+	if (n > first)
+		memcpy(r->buf, (const char *)src + first, n - first);
+}
+
+static void kmsg_copy_out(struct kmsg_ring *r, uint64_t pos, void *dst, size_t n)
+{
+	size_t off = pos & (KMSG_RING_SIZE - 1);
+	size_t first = MIN(n, KMSG_RING_SIZE - off);
+
+	memcpy(dst, r->buf + off, first);
+	if (n > first)
+		memcpy((char *)dst + first, r->buf, n - first);
+}
+
+/* hand s to the serial port in chunks, with \n turned into \r\n */
+static void kmsg_console_write(const char *s, size_t len)
+{
+	char out[128];
+	size_t n = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (n + 2 > sizeof(out)) {
+			serial_write(out, n);
+			n = 0;
+		}
+
+		if (s[i] == '\n')
+			out[n++] = '\r';
+		out[n++] = s[i];
+	}
+
+	if (n)
+		serial_write(out, n);
+}
+
+static void kmsg_log_append(const char *s, size_t len)
+{
+	uint64_t flags = spinlock_acquire_irqsave(&kmsg_log_lock);
+
+	size_t off = kmsg_log_end & (KMSG_LOG_SIZE - 1);
+	size_t first = MIN(len, KMSG_LOG_SIZE - off);
+
+	memcpy(kmsg_log + off, s, first);
+	if (len > first)
+		memcpy(kmsg_log, s + first, len - first);
+	kmsg_log_end += len;
+
+	spinlock_release_irqrestore(&kmsg_log_lock, flags);
+}
+
+/* "[seconds.microseconds] " */
+static size_t kmsg_format_ts(char *out, uint64_t ns)
+{
+	uint64_t usec = ns % NSEC_PER_SEC / NSEC_PER_USEC;
+	size_t n = snprintf(out, "[%d.", 16, (int)(ns / NSEC_PER_SEC));
+
+	for (int i = 5; i >= 0; i--, usec /= 10)
+		out[n + i] = '0' + usec % 10;
+	n += 6;
+
+	out[n++] = ']';
+	out[n++] = ' ';
+	return n;
+}
+
+/* print a message, called with kmsg_console_lock held */
+static void kmsg_emit(struct kmsg_hdr *hdr, const char *text)
+{
+	char ts[32];
+	size_t n = 0;
+
+	/* continuations of a line don't get a timestamp of their own */
+	if (kmsg_line_start)
+		n = kmsg_format_ts(ts, hdr->ts);
+
+	kmsg_log_append(ts, n);
+	kmsg_log_append(text, hdr->len);
+	kmsg_console_write(ts, n);
+	kmsg_console_write(text, hdr->len);
+
+	if (hdr->len)
+		kmsg_line_start = text[hdr->len - 1] == '\n';
+}
+
+/* print the oldest message in the rings, false if there is none */
+static bool kmsg_emit_next()
+{
+	struct kmsg_ring *oldest = NULL;
+	struct kmsg_hdr hdr;
+
+	for (unsigned i = 0; i < kmsg_num_cpus; i++) {
+		struct kmsg_ring *r = &kmsg_rings[kmsg_cpus[i]];
+		struct kmsg_hdr h;
+
+		if (smp_load_acquire(&r->head) == r->tail)
+			continue;
+
+		kmsg_copy_out(r, r->tail, &h, sizeof(h));
+		if (oldest == NULL || h.seq < hdr.seq) {
+			oldest = r;
+			hdr = h;
+		}
+	}
+
+	if (oldest == NULL)
+		return false;
+
+	kmsg_copy_out(oldest, oldest->tail + sizeof(hdr), kmsg_text, hdr.len);
+	smp_store_release(&oldest->tail, oldest->tail + KMSG_REC_SIZE(hdr.len));
+
+	kmsg_emit(&hdr, kmsg_text);
+	return true;
+}
+
+/* say how many messages were lost since the last time, with the lock held */
+static void kmsg_emit_dropped()
+{
+	for (unsigned i = 0; i < kmsg_num_cpus; i++) {
+		struct kmsg_ring *r = &kmsg_rings[kmsg_cpus[i]];
+		uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+
+		if (dropped == r->dropped_seen)
+			continue;
+
+		struct kmsg_hdr hdr = { .ts = clock_ns(), .cpu = kmsg_cpus[i] };
+		char text[64];
+
+		hdr.len = snprintf(text, LOG_WARN "kmsg: %d messages dropped on CPU %d\n", sizeof(text),
+				   (int)(dropped - r->dropped_seen), (int)kmsg_cpus[i]);
+		kmsg_emit(&hdr, text);
+
+		r->dropped_seen = dropped;
+	}
+}
+
+static bool kmsg_rings_pending()
+{
+	for (unsigned i = 0; i < kmsg_num_cpus; i++) {
+		struct kmsg_ring *r = &kmsg_rings[kmsg_cpus[i]];
+
+		if (smp_load_acquire(&r->head) != __atomic_load_n(&r->tail, __ATOMIC_RELAXED))
+			return true;
+		if (__atomic_load_n(&r->dropped, __ATOMIC_RELAXED) != r->dropped_seen)
+			return true;
+	}
+
+	return false;
+}
+
+/* Print everything in the rings. A caller that finds the console busy leaves
+ * its messages to the holder, which looks at the rings again after unlocking.
+ */
+static void kmsg_flush()
+{
+	do {
+		if (!spinlock_try_acquire(&kmsg_console_lock))
+			return;
+
+		while (kmsg_emit_next())
+			;
+		kmsg_emit_dropped();
+
+		spinlock_release(&kmsg_console_lock);
+		smp_mb();
+	} while (kmsg_rings_pending());
+}
+
+/* for CPUs without a ring */
+static void kmsg_print_direct(const char *text, size_t len)
+{
+	struct kmsg_hdr hdr = { .ts = clock_ns(), .len = len };
+	hdr.seq = __atomic_fetch_add(&kmsg_seq, 1, __ATOMIC_RELAXED);
+
+	uint64_t flags = irq_save();
+	spinlock_acquire(&kmsg_console_lock);
+	kmsg_emit(&hdr, text);
+	spinlock_release(&kmsg_console_lock);
+	irq_restore(flags);
+}
+
+/* log len bytes of text, never waits for the console once the rings are set up */
+void kmsg_store(const char *text, size_t len)
+{
+	len = MIN(len, KMSG_TEXT_MAX);
+
+	if (!kmsg_ready) {
+		kmsg_print_direct(text, len);
+		return;
+	}
+
+	uint64_t flags = irq_save();
+	uint8_t cpu = cpu_id();
+	struct kmsg_ring *r = &kmsg_rings[cpu];
+
+	if (r->buf == NULL) {
+		irq_restore(flags);
+		kmsg_print_direct(text, len);
+		return;
+	}
+
+	uint64_t head = r->head;
+	if (KMSG_RING_SIZE - (head - smp_load_acquire(&r->tail)) >= KMSG_REC_SIZE(len)) {
+		struct kmsg_hdr hdr = { .ts = clock_ns(), .len = len, .cpu = cpu };
+		hdr.seq = __atomic_fetch_add(&kmsg_seq, 1, __ATOMIC_RELAXED);
+
+		kmsg_copy_in(r, head, &hdr, sizeof(hdr));
+		kmsg_copy_in(r, head + sizeof(hdr), text, len);
+		smp_store_release(&r->head, head + KMSG_REC_SIZE(len));
+	} else {
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+	}
+
+	irq_restore(flags);
+
+	if (kmsg_deferred) {
+		if (!kmsg_pending)
+			kmsg_pending = true;
+	} else {
+		smp_mb();
+		kmsg_flush();
+	}
+}
+
+/* Wake kmsgd if there are messages. Not done by kprintf itself, which may be
+ * called with scheduler locks held, but by the scheduler where it holds none.
+ */
+void kmsg_kick()
+{
+	if (kmsg_pending)
+		waitq_wake_one(&kmsg_wq);
+}
+
+static void kmsgd()
+{
+	sti();
+
+	while (1) {
+		wait_event(&kmsg_wq, kmsg_pending);
+		kmsg_pending = false;
+
+		kmsg_flush();
+	}
+}
+
+/* set up the ring of this CPU, called from percpu_init */
+void kmsg_init_cpu()
+{
+	uint8_t id = cpu_id();
+	struct kmsg_ring *r = &kmsg_rings[id];
+
+	r->buf = buddy_alloc(KMSG_RING_SIZE);
+	if (r->buf == NULL)
+		return;
+
+	unsigned n = __atomic_fetch_add(&kmsg_num_cpus, 1, __ATOMIC_RELAXED);
+	kmsg_cpus[n] = id;
+
+	kmsg_ready = true;
+}
+
+/* hand the console to kmsgd, once the scheduler runs */
+void kmsg_init()
+{
+	waitq_init(&kmsg_wq);
+
+	struct proc *proc = proc_create_kthread(kmsgd);
+	proc_set_nice(proc, KMSG_NICE);
+
+	/* anything logged while switching over is printed by the first run */
+	kmsg_pending = true;
+	kmsg_deferred = true;
+}
+
+/* Print what is left in the rings and from now on print every message right
+ * away, called on panic once the serial port is polled
+ */
+void kmsg_panic()
+{
+	kmsg_deferred = false;
+
+	for (int i = 0; i < 1000 && !spinlock_try_acquire(&kmsg_console_lock); i++)
+		cpu_relax();
+
+	/* whoever had the console is not going to finish */
+	while (kmsg_emit_next())
+		;
+
+	spinlock_release(&kmsg_console_lock);
+}
+
+/* /dev/kmsg: the console text kept in kmsg_log
+ *
+ * Offsets start at the oldest byte still kept. Once the log wraps they move
+ * with it, so like /dev/slabinfo a reader sees a consistent snapshot only if
+ * nothing is logged while it reads.
+ */
+static ssize_t kmsg_read(void *dev, void *buf, size_t offset, size_t size)
+{
+	(void)dev;
+
+	uint64_t flags = spinlock_acquire_irqsave(&kmsg_log_lock);
+
+	uint64_t start = kmsg_log_end > KMSG_LOG_SIZE ? kmsg_log_end - KMSG_LOG_SIZE : 0;
+	ssize_t ret = 0;
+
+	if (offset < kmsg_log_end - start) {
+		ret = MIN(size, kmsg_log_end - start - offset);
+
+		size_t off = (start + offset) & (KMSG_LOG_SIZE - 1);
+		size_t first = MIN((size_t)ret, KMSG_LOG_SIZE - off);
+
+		memcpy(buf, kmsg_log + off, first);
+		if ((size_t)ret > first)
+			memcpy((char *)buf + first, kmsg_log, ret - first);
+	}
+
+	spinlock_release_irqrestore(&kmsg_log_lock, flags);
+
+	return ret;
+}
+
+/* what is written goes into the log like a kprintf */
+static ssize_t kmsg_write(void *dev, void *buf, size_t offset, size_t size)
+{
+	(void)dev;
+
+	kmsg_store(buf, size);
+	return size;
+}
+
+struct devfs_dev_info kmsg_dev_info = {
+	.dev = NULL,
+	.read = kmsg_read,
+	.write = kmsg_write,
+};
@@ -1,31 +1,143 @@
 #include <kernel/common.h>
 #include <kernel/lock.h>
+#include <kernel/wait.h>
 
-#include <kernel/proc.h>
+#define TICKET_SHIFT 16
+#define TICKET_MASK 0xFFFF
 
-static uint64_t spinlock_attempt_acquire(spinlock_t *lock)
+void spinlock_acquire(spinlock_t *lock)
 {
-	return atomic_cmpxchg(lock, 0, 1);
+	uint16_t ticket = __atomic_fetch_add(lock, 1 << TICKET_SHIFT, __ATOMIC_ACQUIRE) >> TICKET_SHIFT;
+
+	while (1) {
+		uint16_t owner = __atomic_load_n(lock, __ATOMIC_ACQUIRE) & TICKET_MASK;
+		if (owner == ticket)
+			return;
+
+		/* back off in proportion to the number of waiters ahead */
+		for (uint16_t i = ticket - owner; i > 0; i--)
+			cpu_relax();
+	}
 }
 
-void spinlock_acquire(spinlock_t *lock)
+/* returns true if the lock was taken */
+bool spinlock_try_acquire(spinlock_t *lock)
 {
-	while (spinlock_attempt_acquire(lock))
-		;
+	uint32_t val = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+	if ((val & TICKET_MASK) != (val >> TICKET_SHIFT))
+		return false;
+
+	return __atomic_compare_exchange_n(lock, &val, val + (1 << TICKET_SHIFT), false, __ATOMIC_ACQUIRE,
+					   __ATOMIC_RELAXED);
 }
 
 void spinlock_release(spinlock_t *lock)
 {
-	atomic_cmpxchg(lock, 1, 0);
+	/* only the holder writes the low half, a plain store is enough */
+	uint16_t *owner = (uint16_t *)lock;
+	__atomic_store_n(owner, *owner + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t spinlock_acquire_irqsave(spinlock_t *lock)
+{
+	uint64_t flags = irq_save();
+	spinlock_acquire(lock);
+	return flags;
+}
+
+void spinlock_release_irqrestore(spinlock_t *lock, uint64_t flags)
+{
+	spinlock_release(lock);
+	irq_restore(flags);
+}
+
+void read_lock(rwlock_t *lock)
+{
+	while (1) {
+		uint32_t val = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+		if (!(val & (RWLOCK_WRITER | RWLOCK_WAITING)) &&
+		    __atomic_compare_exchange_n(lock, &val, val + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+
+		cpu_relax();
+	}
+}
+
+void read_unlock(rwlock_t *lock)
+{
+	__atomic_sub_fetch(lock, 1, __ATOMIC_RELEASE);
+}
+
+void write_lock(rwlock_t *lock)
+{
+	while (1) {
+		uint32_t val = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+		/* no readers and no writer, taking it clears the waiting bit */
+		if ((val & ~RWLOCK_WAITING) == 0 &&
+		    __atomic_compare_exchange_n(lock, &val, RWLOCK_WRITER, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return;
+
+		if (!(val & RWLOCK_WAITING))
+			__atomic_fetch_or(lock, RWLOCK_WAITING, __ATOMIC_RELAXED);
+
+		cpu_relax();
+	}
+}
+
+void write_unlock(rwlock_t *lock)
+{
+	__atomic_fetch_and(lock, ~RWLOCK_WRITER, __ATOMIC_RELEASE);
+}
+
+void mcs_acquire(mcs_lock_t *lock, struct mcs_node *node)
+{
+	node->next = NULL;
+	node->locked = true;
+
+	struct mcs_node *prev = __atomic_exchange_n(lock, node, __ATOMIC_ACQ_REL);
+	if (prev == NULL)
+		return;
+
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+
+	while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+		cpu_relax();
+}
+
+void mcs_release(mcs_lock_t *lock, struct mcs_node *node)
+{
+	struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+	if (next == NULL) {
+		/* no known successor, try to leave the lock empty */
+		struct mcs_node *expected = node;
+		if (__atomic_compare_exchange_n(lock, &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+
+		/* a waiter swapped itself in but hasn't linked to us yet */
+		while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+			cpu_relax();
+	}
+
+	__atomic_store_n(&next->locked, false, __ATOMIC_RELEASE);
+}
+
+void mtx_init(mtx_t *mtx)
+{
+	mtx->locked = 0;
+	waitq_init(&mtx->wq);
 }
 
 void mtx_acquire(mtx_t *mtx)
 {
-	while (spinlock_attempt_acquire(mtx))
-		sswtch();
+	wait_event(&mtx->wq, spinlock_try_acquire(&mtx->locked));
 }
 
 void mtx_release(mtx_t *mtx)
 {
-	spinlock_release(mtx);
+	spinlock_release(&mtx->locked);
+	waitq_wake_one(&mtx->wq);
 }
@@ -4,11 +4,11 @@
 #include <kernel/slab.h>
 #include <kernel/rbtree.h>
 
-static slab_t *rbt_slab;
+static struct kmem_cache *rbt_cache;
 
 void rbt_slab_init()
 {
-	rbt_slab = slab_create(sizeof(struct rbnode), 1 * MB, 0);
+	rbt_cache = kmem_cache_create("rbnode", sizeof(struct rbnode), 0, 0, NULL);
 }
 
 static void rbt_rotate_right(struct rbtree *tree, struct rbnode *node)
@@ -104,6 +104,24 @@ static void rbt_insert_fixup(struct rbtree *tree, struct rbnode *node)
 		tree->root->color = RB_BLACK;
 }
 
+static void rbt_link_at(struct rbtree *tree, struct rbnode *parent, struct rbnode *new)
+{
+	new->parent = parent;
+	new->left = NULL;
+	new->right = NULL;
+	new->color = RB_RED;
+
+	if (parent == NULL)
+		tree->root = new;
+	else if (new->key < parent->key)
+		parent->left = new;
+	else
+		parent->right = new;
+
+	rbt_insert_fixup(tree, new);
+	tree->num_nodes++;
+}
+
 struct rbnode *rbt_insert(struct rbtree *tree, uint64_t key)
 {
 	struct rbnode *node = tree->root;
@@ -120,36 +138,45 @@ struct rbnode *rbt_insert(struct rbtree *tree, uint64_t key)
 		}
 	}
 
-	struct rbnode *new = slab_alloc(rbt_slab);
+	struct rbnode *new = kmem_cache_alloc(rbt_cache);
 	if (new == NULL)
 		return NULL;
 
 	new->key = key;
-	new->parent = parent;
-	new->left = NULL;
-	new->right = NULL;
-	new->color = RB_RED;
-
 	new->value = 0;
 	new->value2 = 0;
 	new->value3 = 0;
 
 	spinlock_acquire(&tree->lock);
-
-	if (parent == NULL)
-		tree->root = new;
-	else if (key < parent->key)
-		parent->left = new;
-	else
-		parent->right = new;
-
-	rbt_insert_fixup(tree, new);
-	tree->num_nodes++;
+	rbt_link_at(tree, parent, new);
 	spinlock_release(&tree->lock);
 
 	return new;
 }
 
+/* Insert a node owned by the caller, node->key must be set. Unlike rbt_insert,
+ * duplicate keys are allowed and are kept in insertion order
+ */
+void rbt_link(struct rbtree *tree, struct rbnode *new)
+{
+	spinlock_acquire(&tree->lock);
+
+	struct rbnode *node = tree->root;
+	struct rbnode *parent = NULL;
+
+	while (node != NULL) {
+		parent = node;
+		if (new->key < node->key)
+			node = node->left;
+		else
+			node = node->right;
+	}
+
+	rbt_link_at(tree, parent, new);
+
+	spinlock_release(&tree->lock);
+}
+
 static void rbt_transplant(struct rbtree *tree, struct rbnode *old, struct rbnode *new)
 {
 	if (old->parent == NULL)
@@ -254,22 +281,19 @@ struct rbnode *rbt_minimum(struct rbnode *node)
 	return node;
 }
 
-void rbt_delete(struct rbtree *tree, struct rbnode *del)
+/* take del out of the tree without freeing it */
+static void rbt_remove(struct rbtree *tree, struct rbnode *del)
 {
-	spinlock_acquire(&tree->lock);
 	if (!del->left) {
 		/* case 0: left is NULL */
 
 		rbt_transplant(tree, del, del->right);
 		rbt_delete_fixup(tree, del->right);
-		slab_free(rbt_slab, del);
-
 	} else if (!del->right) {
 		/* case 1: right is NULL */
 
 		rbt_transplant(tree, del, del->left);
 		rbt_delete_fixup(tree, del->left);
-		slab_free(rbt_slab, del);
 	} else {
 		/* case 2: neither is NULL */
 
@@ -298,6 +322,25 @@ void rbt_delete(struct rbtree *tree, struct rbnode *del)
 	}
 
 	tree->num_nodes--;
+}
+
+void rbt_delete(struct rbtree *tree, struct rbnode *del)
+{
+	spinlock_acquire(&tree->lock);
+
+	bool has_both = del->left && del->right;
+	rbt_remove(tree, del);
+	if (!has_both)
+		kmem_cache_free(rbt_cache, del);
+
+	spinlock_release(&tree->lock);
+}
+
+/* counterpart of rbt_link, the node is not freed */
+void rbt_unlink(struct rbtree *tree, struct rbnode *node)
+{
+	spinlock_acquire(&tree->lock);
+	rbt_remove(tree, node);
 	spinlock_release(&tree->lock);
 }
 
@@ -1,15 +1,27 @@
 /* SPDX-License-Identifier: GPL-2.0-only */
-#include "kernel/slab.h"
 #include <kernel/common.h>
+#include <kernel/atomic.h>
+#include <kernel/lock.h>
 #include <kernel/ringbuf.h>
+#include <kernel/slab.h>
 
-ringbuf_t *ringbuf_create(size_t size)
+/* size is rounded up to a power of two */
+ringbuf_t *ringbuf_create(size_t size, uint32_t flags)
 {
 	ringbuf_t *rb = kzalloc(sizeof(ringbuf_t), ALLOC_KERN);
-	rb->buf = kmalloc(size, ALLOC_KERN);
-	rb->size = size;
-	rb->head = 0;
-	rb->tail = 0;
+	if (rb == NULL)
+		return NULL;
+
+	rb->size = npow2(size);
+	rb->buf = kmalloc(rb->size, ALLOC_KERN);
+	if (rb->buf == NULL) {
+		kfree(rb);
+		return NULL;
+	}
+
+	rb->flags = flags;
+	waitq_init(&rb->readers);
+	waitq_init(&rb->writers);
 	return rb;
 }
 
@@ -19,28 +31,121 @@ void ringbuf_destroy(ringbuf_t *rb)
 	ATTEMPT_FREE(rb);
 }
 
+/* the n bytes at pos wrap around the end of buf at most once */
+static void ringbuf_copy_in(ringbuf_t *rb, size_t pos, const char *src, size_t n)
+{
+	size_t off = pos & (rb->size - 1);
+	size_t first = MIN(n, rb->size - off);
+
+	memcpy(rb->buf + off, src, first);
+	if (n > first)
+		memcpy(rb->buf, src + first, n - first);
+}
+
+static void ringbuf_copy_out(ringbuf_t *rb, size_t pos, char *dst, size_t n)
+{
+	size_t off = pos & (rb->size - 1);
+	size_t first = MIN(n, rb->size - off);
+
+	memcpy(dst, rb->buf + off, first);
+	if (n > first)
+		memcpy(dst + first, rb->buf, n - first);
+}
+
+/* Several producers: claim space, fill it, then wait for the producers that
+ * claimed space before this one to publish theirs. Interrupts are off so a
+ * producer can't be preempted by one that waits on it.
+ */
+static size_t ringbuf_write_mp(ringbuf_t *rb, const char *buf, size_t count)
+{
+	uint64_t flags = irq_save();
+
+	size_t pos = __atomic_load_n(&rb->reserve, __ATOMIC_RELAXED);
+	size_t n;
+	do {
+		n = MIN(count, rb->size - (pos - smp_load_acquire(&rb->tail)));
+		if (n == 0) {
+			irq_restore(flags);
+			return 0;
+		}
+	} while (!__atomic_compare_exchange_n(&rb->reserve, &pos, pos + n, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	ringbuf_copy_in(rb, pos, buf, n);
+
+	while (smp_load_acquire(&rb->head) != pos)
+		cpu_relax();
+	smp_store_release(&rb->head, pos + n);
+
+	irq_restore(flags);
+	return n;
+}
+
+/* copy as much of buf as fits, returns the number of bytes written */
 size_t ringbuf_write(ringbuf_t *rb, const char *buf, size_t count)
 {
-	size_t written = 0;
-	while (count--) {
-		if ((rb->head + 1) % rb->size == rb->tail)
-			break;
-		rb->buf[rb->head] = *buf++;
-		rb->head = (rb->head + 1) % rb->size;
-		written++;
+	size_t n;
+
+	if (rb->flags & RINGBUF_MP) {
+		n = ringbuf_write_mp(rb, buf, count);
+	} else {
+		size_t head = rb->head;
+		n = MIN(count, rb->size - (head - smp_load_acquire(&rb->tail)));
+		if (n) {
+			ringbuf_copy_in(rb, head, buf, n);
+			smp_store_release(&rb->head, head + n);
+		}
 	}
-	return written;
+
+	if (n)
+		waitq_wake_all(&rb->readers);
+
+	return n;
 }
 
+/* Copy out up to count bytes, returns the number of bytes read
+ *
+ * The bytes are copied before tail is advanced, so no producer can overwrite
+ * them in the meantime. If another reader advanced tail first the copy is
+ * thrown away and done again.
+ */
 size_t ringbuf_read(ringbuf_t *rb, char *buf, size_t count)
 {
-	size_t read = 0;
-	while (count--) {
-		if (rb->head == rb->tail)
-			break;
-		*buf++ = rb->buf[rb->tail];
-		rb->tail = (rb->tail + 1) % rb->size;
-		read++;
+	size_t tail = smp_load_acquire(&rb->tail);
+	size_t n;
+
+	do {
+		n = MIN(count, smp_load_acquire(&rb->head) - tail);
+		if (n == 0)
+			return 0;
+
+		ringbuf_copy_out(rb, tail, buf, n);
+	} while (!__atomic_compare_exchange_n(&rb->tail, &tail, tail + n, false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+	waitq_wake_all(&rb->writers);
+
+	return n;
+}
+
+/* like ringbuf_write, but block until all of buf is written */
+size_t ringbuf_write_wait(ringbuf_t *rb, const char *buf, size_t count)
+{
+	size_t written = 0;
+
+	while (written < count) {
+		size_t n;
+		wait_event(&rb->writers, (n = ringbuf_write(rb, buf + written, count - written)) != 0);
+		written += n;
 	}
+
+	return written;
+}
+
+/* like ringbuf_read, but block until there is something to read */
+size_t ringbuf_read_wait(ringbuf_t *rb, char *buf, size_t count)
+{
+	size_t read;
+
+	wait_event(&rb->readers, (read = ringbuf_read(rb, buf, count)) != 0);
+
 	return read;
 }
@@ -8,6 +8,7 @@ sem_t *sem_create(int count)
 	sem_t *sem = kmalloc(sizeof(sem_t), ALLOC_KERN);
 	sem->count = count;
 	sem->lock = 0;
+	waitq_init(&sem->wq);
 	return sem;
 }
 
@@ -30,9 +31,16 @@ int sem_trywait(sem_t *sem)
 	return ret;
 }
 
+void sem_wait(sem_t *sem)
+{
+	wait_event(&sem->wq, sem_trywait(sem) == 0);
+}
+
 void sem_post(sem_t *sem)
 {
 	spinlock_acquire(&sem->lock);
 	sem->count++;
 	spinlock_release(&sem->lock);
+
+	waitq_wake_one(&sem->wq);
 }
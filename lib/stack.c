@@ -2,11 +2,11 @@
 #include <kernel/slab.h>
 #include <lib/stack.h>
 
-slab_t *stack_slab;
+struct kmem_cache *stack_cache;
 
 void stack_init()
 {
-	stack_slab = slab_create(sizeof(struct stack_node), 16 * KB, 0);
+	stack_cache = kmem_cache_create("stack_node", sizeof(struct stack_node), 0, 0, NULL);
 }
 
 struct stack *stack_create()
@@ -22,7 +22,7 @@ struct stack *stack_create()
 
 void stack_push(struct stack *stack, void *data)
 {
-	struct stack_node *node = slab_alloc(stack_slab);
+	struct stack_node *node = kmem_cache_alloc(stack_cache);
 	if (!node)
 		return;
 
@@ -39,7 +39,7 @@ void *stack_pop(struct stack *stack)
 	struct stack_node *node = stack->top;
 	stack->top = node->next;
 	void *data = node->data;
-	slab_free(stack_slab, node);
+	kmem_cache_free(stack_cache, node);
 
 	return data;
 }
@@ -1,30 +1,10 @@
 /* SPDX-License-Identifier: GPL-2.0-only */
 #include <kernel/common.h>
 
-#include <dev/serial.h>
+#include <kernel/kmsg.h>
 
 #include <stdarg.h>
 
-spinlock_t printf_lock = 0;
-
-static inline void printf_out(char c)
-{
-	if(c == '\n')
-		serial_putchar('\r');
-	serial_putchar(c);
-}
-
-static int printf_write(const char *restrict s)
-{
-	char c;
-	int ret = 0;
-	while ((c = *s++)) {
-		printf_out(c);
-		ret++;
-	}
-	return ret;
-}
-
 int vsnprintf(char *str, const char *restrict fmt, size_t size, va_list args)
 {
 	int ret = 0;
@@ -119,7 +99,7 @@ int vsnprintf(char *str, const char *restrict fmt, size_t size, va_list args)
 				}
 				break;
 			default:
-				printf_out(c);
+				str[ret] = c;
 				ret++;
 				break;
 printf_reverse:
@@ -150,15 +130,14 @@ int snprintf(char *str, const char *restrict fmt, size_t size, ...)
 	return ret;
 }
 
+/* formats into the kernel log, see lib/kmsg.c */
 int kprintf(const char *restrict fmt, ...)
 {
-	spinlock_acquire(&printf_lock);
-	char buf[2048] = { 0 };
+	char buf[KMSG_TEXT_MAX + 1] = { 0 };
 	va_list args;
 	va_start(args, fmt);
-	int ret = vsnprintf(buf, fmt, 1024, args);
+	int ret = vsnprintf(buf, fmt, KMSG_TEXT_MAX, args);
 	va_end(args);
-	printf_write(buf);
-	spinlock_release(&printf_lock);
+	kmsg_store(buf, strlen(buf));
 	return ret;
 }
@@ -1,17 +1,35 @@
 /* SPDX-License-Identifier: GPL-2.0-only */
 #include <kernel/slab.h>
 #include <kernel/lock.h>
+#include <kernel/cpufeature.h>
+#include <kernel/fpu.h>
 
 #include <lib/string.h>
 
-void *memcpy(void *dest, const void *src, size_t num)
+/* copies at least this long amortize saving the FPU state for memcpy_sse */
+#define MEMCPY_SSE_MIN 4096
+
+/* set by string_init once the FPU can be used */
+static bool memcpy_use_sse = false;
+
+/* word-at-a-time helpers for the string functions */
+typedef uint64_t __attribute__((may_alias)) word_t;
+
+#define WORD_ONES 0x0101010101010101ull
+#define WORD_HIGHS 0x8080808080808080ull
+#define WORD_HAS_ZERO(_w) (((_w) - WORD_ONES) & ~(_w) & WORD_HIGHS)
+
+/* memcpy on CPUs without ERMS, where rep movsq is slow to start */
+void *memcpy_generic(void *dest, const void *src, size_t num)
 {
-	char *d = (char *)dest;
-	char *s = (char *)src;
-	for (size_t i = 0; i < num; i++) {
-		*d++ = *s++;
+	if (memcpy_use_sse && num >= MEMCPY_SSE_MIN) {
+		uint64_t flags = kernel_fpu_begin();
+		memcpy_sse(dest, src, num);
+		kernel_fpu_end(flags);
+		return dest;
 	}
-	return dest;
+
+	return memcpy_movsq(dest, src, num);
 }
 
 int strcmp(const char *a, const char *b)
@@ -53,47 +71,58 @@ char *strncpy(char *dest, const char *src, size_t n)
 	return dest;
 }
 
+/* An aligned word never crosses a page, so reading the whole word the
+ * terminator is in can't fault
+ */
 size_t strlen(const char *c)
 {
 	const char *b = c;
+
+	while ((uintptr_t)b & 7) {
+		if (!*b)
+			return b - c;
+		b++;
+	}
+
+	const word_t *w = (const word_t *)b;
+	while (!WORD_HAS_ZERO(*w))
+		w++;
+
+	b = (const char *)w;
 	while (*b)
 		b++;
+
 	return b - c;
 }
 
 int memcmp(const void *aa, const void *bb, size_t num)
 {
-	const char *a = (const char *)aa;
-	const char *b = (const char *)bb;
+	const unsigned char *a = (const unsigned char *)aa;
+	const unsigned char *b = (const unsigned char *)bb;
+
+	/* skip equal words, the bytes of the first differing one are compared below */
+	while (num >= 8 && *(const word_t *)a == *(const word_t *)b) {
+		a += 8;
+		b += 8;
+		num -= 8;
+	}
+
 	for (size_t i = 0; i < num; i++) {
-		if (*a++ != *b++)
-			return a - b;
+		if (a[i] != b[i])
+			return a[i] - b[i];
 	}
+
 	return 0;
 }
 
-void *memset(void *str, int c, size_t n)
+/* large copies may go through SSE, after fpu_init */
+void string_init()
 {
-	uintptr_t ptr = (uintptr_t)str;
-	uintptr_t val = (uintptr_t)c;
-	val |= val << 8;
-	val |= val << 16;
-	val |= val << 32;
-
-	for (size_t i = 0; i < (n >> 3); i++) {
-		*(uintptr_t *)ptr = val;
-		ptr += 8;
-	}
-
-	if (n & 7) {
-		ptr = (uintptr_t)str + (n & (~7ull));
-		for (size_t i = 0; i < (n & 7); i++) {
-			*(char *)ptr = c;
-			ptr++;
-		}
-	}
+	memcpy_use_sse = true;
 
-	return str;
+#ifdef KDEBUG
+	kprintf(LOG_DEBUG "string: using %s memcpy\n", boot_cpu_has(CPU_FEATURE_ERMS) ? "rep movsb" : "sse");
+#endif
 }
 
 int atoi(const char *a)
@@ -0,0 +1,257 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <kernel/common.h>
+#include <kernel/atomic.h>
+#include <kernel/lock.h>
+#include <kernel/mem.h>
+#include <kernel/msr.h>
+#include <kernel/percpu.h>
+#include <kernel/proc.h>
+#include <kernel/static_key.h>
+#include <kernel/trace.h>
+
+#include <fs/devfs.h>
+
+/* Event tracing
+ *
+ * Each tracepoint is a branch on its own static key. An enabled one stores the
+ * event in the ring of its CPU with interrupts off, overwriting the oldest
+ * event once the ring is full, so the rings always hold the latest events.
+ * /dev/trace hands them out merged by TSC and counts what was overwritten
+ * before it got there. The rings are only allocated once an event is enabled.
+ */
+
+#define TRACE_RING_BYTES (TRACE_RING_EVENTS * sizeof(struct trace_event))
+
+struct trace_ring {
+	struct trace_event *buf;
+	uint64_t head; /* only written by the CPU that owns the ring */
+	uint64_t tail; /* next event for /dev/trace, under trace_read_lock */
+	uint64_t lost; /* overwritten since the last TRACE_LOST */
+} ALIGN(CACHELINE_SIZE);
+
+static struct trace_ring trace_rings[256];
+static spinlock_t trace_read_lock = 0;
+static spinlock_t trace_alloc_lock = 0;
+
+struct static_key trace_keys[TRACE_NUM_EVENTS];
+
+static const char *trace_names[TRACE_NUM_EVENTS] = {
+	[TRACE_LOST] = "lost",
+	[TRACE_SYSCALL_ENTER] = "syscall_enter",
+	[TRACE_SYSCALL_EXIT] = "syscall_exit",
+	[TRACE_SCHED_SWITCH] = "sched_switch",
+	[TRACE_BLOCK_READ] = "block_read",
+	[TRACE_BLOCK_WRITE] = "block_write",
+	[TRACE_BLOCK_DONE] = "block_done",
+	[TRACE_BUDDY_ALLOC] = "buddy_alloc",
+	[TRACE_SLAB_ALLOC] = "slab_alloc",
+	[TRACE_PAGE_FAULT] = "page_fault",
+};
+
+void trace_event(uint16_t id, uint64_t arg0, uint64_t arg1)
+{
+	uint64_t flags = irq_save();
+	uint8_t cpu = cpu_id();
+	struct trace_ring *r = &trace_rings[cpu];
+
+	if (r->buf != NULL) {
+		struct proc *proc = proc_current();
+		struct trace_event *e = &r->buf[r->head & (TRACE_RING_EVENTS - 1)];
+
+		e->tsc = rdtsc();
+		e->id = id;
+		e->cpu = cpu;
+		e->pid = proc ? proc->pid : 0;
+		e->args[0] = arg0;
+		e->args[1] = arg1;
+
+		smp_store_release(&r->head, r->head + 1);
+	}
+
+	irq_restore(flags);
+}
+
+/* Copy the oldest event of r that is still there to e without consuming it,
+ * false if there is none. Called with trace_read_lock held.
+ */
+static bool trace_peek(struct trace_ring *r, struct trace_event *e)
+{
+	while (1) {
+		uint64_t head = smp_load_acquire(&r->head);
+		if (head == r->tail)
+			return false;
+
+		if (head - r->tail > TRACE_RING_EVENTS) {
+			r->lost += head - TRACE_RING_EVENTS - r->tail;
+			r->tail = head - TRACE_RING_EVENTS;
+		}
+
+		*e = r->buf[r->tail & (TRACE_RING_EVENTS - 1)];
+		smp_rmb();
+
+		/* the slot is only rewritten once head has come around to it */
+		if (smp_load_acquire(&r->head) - r->tail < TRACE_RING_EVENTS)
+			return true;
+
+		r->lost++;
+		r->tail++;
+	}
+}
+
+/* /dev/trace: consumes whole struct trace_events, oldest first, 0 once the
+ * rings are empty. The offset is ignored. Root only, the events hold kernel
+ * addresses and the system call arguments of every process.
+ */
+static ssize_t trace_read(void *dev, void *buf, size_t offset, size_t size)
+{
+	(void)dev;
+
+	struct trace_event *out = buf;
+	size_t max = size / sizeof(struct trace_event);
+	size_t n = 0;
+
+	if (getuid() != 0)
+		return -EPERM;
+
+	if (max == 0)
+		return -EINVAL;
+
+	const uint8_t *ids;
+	unsigned ncpus = proc_cpus(&ids);
+
+	spinlock_acquire(&trace_read_lock);
+
+	while (n < max) {
+		struct trace_ring *oldest = NULL;
+		struct trace_event first;
+
+		for (unsigned i = 0; i < ncpus && n < max; i++) {
+			struct trace_ring *r = &trace_rings[ids[i]];
+			struct trace_event e;
+
+			if (r->buf == NULL || !trace_peek(r, &e))
+				continue;
+
+			/* the losses come right before the first event that is left */
+			if (r->lost) {
+				out[n++] = (struct trace_event){ .tsc = e.tsc, .id = TRACE_LOST, .cpu = ids[i], .args = { r->lost } };
+				r->lost = 0;
+			}
+
+			if (oldest == NULL || e.tsc < first.tsc) {
+				oldest = r;
+				first = e;
+			}
+		}
+
+		if (oldest == NULL || n == max)
+			break;
+
+		out[n++] = first;
+		oldest->tail++;
+	}
+
+	spinlock_release(&trace_read_lock);
+
+	return n * sizeof(struct trace_event);
+}
+
+/* the rings of all CPUs, before the first event is enabled */
+static int trace_alloc_rings()
+{
+	const uint8_t *ids;
+	unsigned ncpus = proc_cpus(&ids);
+	int ret = 0;
+
+	spinlock_acquire(&trace_alloc_lock);
+	for (unsigned i = 0; i < ncpus; i++) {
+		struct trace_ring *r = &trace_rings[ids[i]];
+		if (r->buf != NULL)
+			continue;
+
+		struct trace_event *buf = buddy_alloc(TRACE_RING_BYTES);
+		if (buf == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		smp_store_release(&r->buf, buf);
+	}
+	spinlock_release(&trace_alloc_lock);
+
+	return ret;
+}
+
+/* turn the event called name on or off, or all of them */
+static int trace_set(const char *name, size_t len, bool on)
+{
+	bool all = len == 3 && !strncmp(name, "all", 3);
+	bool found = false;
+
+	if (on) {
+		int ret = trace_alloc_rings();
+		if (ret < 0)
+			return ret;
+	}
+
+	for (int id = TRACE_LOST + 1; id < TRACE_NUM_EVENTS; id++) {
+		if (!all && (strlen(trace_names[id]) != len || strncmp(name, trace_names[id], len)))
+			continue;
+
+		found = true;
+
+		if (on) {
+			int ret = static_key_enable(&trace_keys[id]);
+			if (ret < 0)
+				return ret;
+		} else {
+			static_key_disable(&trace_keys[id]);
+		}
+
+		kprintf(LOG_INFO "trace: %s %s\n", trace_names[id], on ? "enabled" : "disabled");
+	}
+
+	return found ? 0 : -EINVAL;
+}
+
+/* /dev/trace control: "+name" enables an event and "-name" disables it, "all"
+ * stands for every event. Several can be given, separated by spaces. Root
+ * only, switching an event stops every CPU.
+ */
+static ssize_t trace_write(void *dev, void *buf, size_t offset, size_t size)
+{
+	(void)dev;
+
+	const char *s = buf;
+	size_t i = 0;
+
+	if (getuid() != 0)
+		return -EPERM;
+
+	while (i < size) {
+		if (s[i] == ' ' || s[i] == '\n' || s[i] == '\t') {
+			i++;
+			continue;
+		}
+
+		if (s[i] != '+' && s[i] != '-')
+			return -EINVAL;
+
+		bool on = s[i++] == '+';
+		size_t start = i;
+		while (i < size && s[i] != ' ' && s[i] != '\n' && s[i] != '\t')
+			i++;
+
+		int ret = trace_set(s + start, i - start, on);
+		if (ret < 0)
+			return ret;
+	}
+
+	return size;
+}
+
+struct devfs_dev_info trace_dev_info = {
+	.dev = NULL,
+	.read = trace_read,
+	.write = trace_write,
+};
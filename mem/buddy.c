@@ -6,9 +6,11 @@
 #include <kernel/mem.h>
 #include <kernel/rbtree.h>
 #include <kernel/lock.h>
+#include <kernel/reclaim.h>
+#include <kernel/trace.h>
 
-struct limine_memmap_request map_req = { .id = LIMINE_MEMMAP_REQUEST, .revision = 0 };
-struct limine_kernel_address_request kern_req = { .id = LIMINE_KERNEL_ADDRESS_REQUEST, .revision = 0 };
+volatile struct limine_memmap_request map_req = { .id = LIMINE_MEMMAP_REQUEST, .revision = 0 };
+volatile struct limine_kernel_address_request kern_req = { .id = LIMINE_KERNEL_ADDRESS_REQUEST, .revision = 0 };
 
 #ifdef KDEBUG
 static const char *limine_types[] = { "USABLE",	  "RESERVED",	"ACPI_RECLAIMABLE",
@@ -28,6 +30,15 @@ struct page kdefault_attrs;
 
 paddr_t kcr3 = 0;
 
+/* protects the region bitmaps now that every CPU can allocate */
+static spinlock_t buddy_lock = 0;
+
+size_t buddy_total_pages = 0;
+size_t buddy_free_pages = 0;
+
+struct page_frame *page_frames = NULL;
+size_t num_page_frames = 0;
+
 void *(*alloc_page)(void);
 
 void page_init(paddr_t kpaddr, uintptr_t kvaddr, size_t kernel_size, struct mem_region *regions, size_t num_regions);
@@ -86,6 +97,9 @@ static void buddy_init_region(struct mem_region *region)
 	head->usable_base = curpos;
 	head->usable_len = (npow2(usable_end - curpos) >> 1);
 	head->max_depth = log2(head->usable_len >> 12);
+
+	buddy_total_pages += head->usable_len >> 12;
+	buddy_free_pages += head->usable_len >> 12;
 }
 
 static paddr_t buddy_get_slab(struct buddy_region_header *head, size_t depth, size_t n)
@@ -159,7 +173,8 @@ static paddr_t buddy_alloc_helper(struct buddy_region_header *head, size_t size)
 	return buddy_alloc_traverse(head, 0, 0, tgt_depth);
 }
 
-static void buddy_free_helper(struct buddy_region_header *head, paddr_t paddr)
+/* returns the number of pages freed */
+static size_t buddy_free_helper(struct buddy_region_header *head, paddr_t paddr)
 {
 	/* find the region in the bitmap */
 	paddr_t offset = paddr - head->usable_base;
@@ -189,6 +204,7 @@ static void buddy_free_helper(struct buddy_region_header *head, paddr_t paddr)
 
 	/* mark the region as free */
 	buddy_bitmap_set(head->bitmap, depth, n, BBMAP_FREE);
+	size_t pages = (head->usable_len >> depth) >> 12;
 
 	/* merge with adjacent regions */
 	while (depth > 0 && (buddy_bitmap_get(head->bitmap, depth, n ^ 1) == BBMAP_FREE)) {
@@ -197,25 +213,62 @@ static void buddy_free_helper(struct buddy_region_header *head, paddr_t paddr)
 
 		buddy_bitmap_set(head->bitmap, depth, n, BBMAP_FREE);
 	}
+
+	return pages;
 }
 
-void *buddy_alloc(size_t size)
+static void *buddy_alloc_regions(size_t size)
 {
-	if (size == 0)
-		return NULL;
-
 	/* Linear search because array is small */
 	for (size_t i = 0; i < num_regions; i++) {
-		struct buddy_region_header *head = (void *)(mem_regions[num_regions - i - 1].base | hhdm_start);
+		struct mem_region *region = &mem_regions[num_regions - i - 1];
+		if (!region->usable)
+			continue;
 
+		struct buddy_region_header *head = (void *)(region->base | hhdm_start);
+
+		spinlock_acquire(&buddy_lock);
 		paddr_t ret = buddy_alloc_helper(head, size);
-		if (ret != 0)
+		spinlock_release(&buddy_lock);
+
+		if (ret != 0) {
+			size_t order = log2(size >> 12);
+
+			struct page_frame *frame = phys_to_frame(ret);
+			if (frame != NULL) {
+				frame->flags = PF_BUDDY;
+				frame->order = order;
+				frame->refcount = 1;
+				frame->slab = NULL;
+			}
+
+			__atomic_sub_fetch(&buddy_free_pages, 1ull << order, __ATOMIC_RELAXED);
+
 			return (void *)(ret | hhdm_start);
+		}
 	}
 
 	return NULL;
 }
 
+void *buddy_alloc(size_t size)
+{
+	if (size == 0)
+		return NULL;
+
+	void *ret = buddy_alloc_regions(size);
+
+	/* release cached memory and retry once before failing */
+	if (ret == NULL && size >= 0x1000 && reclaim_pages(1ull << log2(size >> 12)))
+		ret = buddy_alloc_regions(size);
+
+	if (buddy_free_pages < reclaim_wmark_low)
+		reclaim_wakeup();
+
+	trace(TRACE_BUDDY_ALLOC, size, ret);
+	return ret;
+}
+
 void buddy_free(void *ptr)
 {
 	if (ptr == NULL)
@@ -223,12 +276,27 @@ void buddy_free(void *ptr)
 
 	paddr_t paddr = (paddr_t)ptr & ~hhdm_start;
 
+	struct page_frame *frame = phys_to_frame(paddr);
+	if (frame != NULL) {
+		frame->flags = 0;
+		frame->order = 0;
+		frame->refcount = 0;
+	}
+
 	/* Linear search because array is small */
 	for (size_t i = 0; i < num_regions; i++) {
-		struct buddy_region_header *head = (void *)(mem_regions[num_regions - i - 1].base | hhdm_start);
+		struct mem_region *region = &mem_regions[num_regions - i - 1];
+		if (!region->usable)
+			continue;
+
+		struct buddy_region_header *head = (void *)(region->base | hhdm_start);
 
 		if (paddr >= head->usable_base && paddr < (head->usable_base + head->usable_len)) {
-			buddy_free_helper(head, paddr);
+			spinlock_acquire(&buddy_lock);
+			size_t pages = buddy_free_helper(head, paddr);
+			spinlock_release(&buddy_lock);
+
+			__atomic_add_fetch(&buddy_free_pages, pages, __ATOMIC_RELAXED);
 			return;
 		}
 	}
@@ -237,6 +305,49 @@ void buddy_free(void *ptr)
 	assert(0);
 }
 
+void page_frames_set(void *ptr, size_t len, uint16_t flags, struct _slab *slab)
+{
+	struct page_frame *frame = virt_to_frame(ptr);
+	if (frame == NULL)
+		return;
+
+	size_t n = MIN(len >> 12, (size_t)(page_frames + num_page_frames - frame));
+	for (size_t i = 0; i < n; i++, frame++) {
+		frame->flags = (frame->flags & PF_BUDDY) | flags;
+		frame->slab = slab;
+	}
+}
+
+static void page_frames_init()
+{
+	paddr_t max_paddr = 0;
+	for (size_t i = 0; i < num_regions; i++) {
+		if (mem_regions[i].usable)
+			max_paddr = MAX(max_paddr, mem_regions[i].base + mem_regions[i].len);
+	}
+
+	size_t nframes = max_paddr >> 12;
+	size_t size = MAX(npow2(nframes * sizeof(struct page_frame)), 0x1000ull);
+
+	struct page_frame *frames = buddy_alloc(size);
+	if (frames == NULL) {
+		kprintf(LOG_ERROR "Failed to allocate page frame array\n");
+		panic();
+	}
+
+	memset(frames, 0, nframes * sizeof(struct page_frame));
+	page_frames = frames;
+	num_page_frames = nframes;
+
+	/* the array could not describe its own allocation until now */
+	struct page_frame *self = virt_to_frame(frames);
+	self->flags = PF_BUDDY;
+	self->order = log2(size >> 12);
+	self->refcount = 1;
+
+	kprintf(LOG_SUCCESS "Page frame array initialized (%d frames)\n", nframes);
+}
+
 static void *alloc_page_early()
 {
 	static uintptr_t hwm = 0;
@@ -355,6 +466,7 @@ void mem_early_init(char *mem, size_t len)
 			paddr_t r_alloc = buddy_alloc_helper(head, 0x1000);
 			if (r_alloc != 0) {
 				page_found = true;
+				buddy_free_pages--;
 				mem_regions = (void *)(r_alloc | hhdm_start);
 			}
 		}
@@ -364,5 +476,6 @@ void mem_early_init(char *mem, size_t len)
 	memcpy(mem_regions, regions, sizeof(struct mem_region) * num_regions);
 
 	kprintf(LOG_SUCCESS "Buddy allocator initialized\n");
+	page_frames_init();
 	page_init(kpaddr, kvaddr, kernel_size, regions, num_regions);
 }
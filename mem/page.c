@@ -5,20 +5,217 @@
 #include <kernel/slab.h>
 #include <kernel/rbtree.h>
 #include <kernel/proc.h>
+#include <kernel/reclaim.h>
 
-static slab_t *page_slab;
+static struct kmem_cache *pgtable_cache;
 
 extern void *(*alloc_page)();
 
 struct rbtree *kmap_tree = NULL;
 spinlock_t kmap_lock = 0;
 
+/* Page tables emptied by munmap are not released right away. They are kept on
+ * this list and handed back out before the slab is asked for a fresh page, and
+ * the surplus is released in one batch once the list grows past PT_CACHE_HIGH
+ */
+#define PT_CACHE_HIGH 64
+#define PT_CACHE_LOW 16
+
+static uint64_t *pt_cache = NULL;
+static size_t pt_cache_len = 0;
+static spinlock_t pt_cache_lock = 0;
+
+/* unmapping more pages than this from a live map flushes the whole TLB */
+#define TLB_INVLPG_MAX 32
+
+static void pt_defer_poll();
+
 static void *kmap_alloc_page()
 {
-	return slab_alloc(page_slab);
+	if (pt_cache == NULL)
+		pt_defer_poll();
+
+	spinlock_acquire(&pt_cache_lock);
+	uint64_t *ret = pt_cache;
+	if (ret != NULL) {
+		pt_cache = (uint64_t *)ret[0];
+		pt_cache_len--;
+	}
+	spinlock_release(&pt_cache_lock);
+
+	if (ret == NULL)
+		ret = kmem_cache_alloc(pgtable_cache);
+
+	return ret;
+}
+
+struct pt_batch {
+	uint64_t *head;
+	uint64_t *tail;
+	size_t len;
+};
+
+static void pt_batch_add(struct pt_batch *batch, uint64_t *table)
+{
+	table[0] = (uint64_t)batch->head;
+	batch->head = table;
+	if (batch->tail == NULL)
+		batch->tail = table;
+	batch->len++;
+}
+
+static void pt_cache_put(struct pt_batch *batch)
+{
+	uint64_t *release = NULL;
+	uint64_t *last = NULL;
+
+	spinlock_acquire(&pt_cache_lock);
+	batch->tail[0] = (uint64_t)pt_cache;
+	pt_cache = batch->head;
+	pt_cache_len += batch->len;
+
+	if (pt_cache_len > PT_CACHE_HIGH) {
+		release = pt_cache;
+		while (pt_cache_len > PT_CACHE_LOW) {
+			last = pt_cache;
+			pt_cache = (uint64_t *)pt_cache[0];
+			pt_cache_len--;
+		}
+		last[0] = 0;
+	}
+	spinlock_release(&pt_cache_lock);
+
+	while (release != NULL) {
+		uint64_t *next = (uint64_t *)release[0];
+		kmem_cache_free(pgtable_cache, release);
+		release = next;
+	}
+}
+
+static void pt_batch_splice(struct pt_batch *dst, struct pt_batch *src)
+{
+	if (src->head == NULL)
+		return;
+
+	src->tail[0] = (uint64_t)dst->head;
+	dst->head = src->head;
+	if (dst->tail == NULL)
+		dst->tail = src->tail;
+	dst->len += src->len;
+}
+
+/* Tables unlinked from the kernel half of the address space, which every PML4
+ * shares, can still be in the paging-structure caches of any CPU. They wait
+ * here until each CPU has been through schedule, which loads CR3, before they
+ * go to pt_cache. pt_deferred waits for the reload counts in pt_deferred_snap
+ * to move, pt_deferring collects what was unlinked since that snapshot.
+ */
+static volatile uint64_t pt_reloads[256];
+static uint64_t pt_deferred_snap[256];
+static struct pt_batch pt_deferred = { NULL, NULL, 0 };
+static struct pt_batch pt_deferring = { NULL, NULL, 0 };
+static spinlock_t pt_defer_lock = 0;
+
+/* called by schedule, which loads CR3 on every way out */
+void tlb_note_reload()
+{
+	pt_reloads[cpu_id()]++;
 }
 
-static uint64_t *pagemap_traverse(uint64_t *this_level, size_t next_num, uint64_t attr)
+/* queue batch, which may be empty, and release what has waited long enough */
+static void pt_defer(struct pt_batch *batch)
+{
+	struct pt_batch done = { NULL, NULL, 0 };
+	const uint8_t *ids;
+	unsigned ncpus = proc_cpus(&ids);
+
+	spinlock_acquire(&pt_defer_lock);
+	pt_batch_splice(&pt_deferring, batch);
+
+	if (pt_deferred.head != NULL) {
+		unsigned i;
+		for (i = 0; i < ncpus; i++) {
+			if (pt_reloads[ids[i]] == pt_deferred_snap[ids[i]])
+				break;
+		}
+
+		if (i == ncpus) {
+			done = pt_deferred;
+			pt_deferred = (struct pt_batch){ NULL, NULL, 0 };
+		}
+	}
+
+	if (pt_deferred.head == NULL && pt_deferring.head != NULL) {
+		pt_deferred = pt_deferring;
+		pt_deferring = (struct pt_batch){ NULL, NULL, 0 };
+		for (unsigned i = 0; i < ncpus; i++)
+			pt_deferred_snap[ids[i]] = pt_reloads[ids[i]];
+	}
+	spinlock_release(&pt_defer_lock);
+
+	if (done.head != NULL)
+		pt_cache_put(&done);
+}
+
+static void pt_defer_poll()
+{
+	struct pt_batch none = { NULL, NULL, 0 };
+
+	if (pt_deferred.head != NULL)
+		pt_defer(&none);
+}
+
+static size_t pt_cache_count()
+{
+	return pt_cache_len;
+}
+
+static size_t pt_cache_scan(size_t nr)
+{
+	uint64_t *release = NULL;
+	size_t freed = 0;
+
+	if (!spinlock_try_acquire(&pt_cache_lock))
+		return 0;
+
+	while (freed < nr && pt_cache != NULL) {
+		uint64_t *table = pt_cache;
+		pt_cache = (uint64_t *)table[0];
+		pt_cache_len--;
+
+		table[0] = (uint64_t)release;
+		release = table;
+		freed++;
+	}
+	spinlock_release(&pt_cache_lock);
+
+	while (release != NULL) {
+		uint64_t *next = (uint64_t *)release[0];
+		kmem_cache_free(pgtable_cache, release);
+		release = next;
+	}
+
+	return freed;
+}
+
+static struct shrinker pt_cache_shrinker = {
+	.name = "pgtable-cache",
+	.count = pt_cache_count,
+	.scan = pt_cache_scan,
+};
+
+static inline size_t pt_count(uint64_t entry)
+{
+	return (entry & PAGE_COUNT_MASK) >> PAGE_COUNT_SHIFT;
+}
+
+static inline void pt_count_add(uint64_t *entry, int64_t n)
+{
+	*entry += (uint64_t)n << PAGE_COUNT_SHIFT;
+}
+
+/* parent is the entry pointing to this_level, or NULL for the PML4 */
+static uint64_t *pagemap_traverse(uint64_t *this_level, uint64_t *parent, size_t next_num, uint64_t attr)
 {
 	uint64_t *r;
 	if (!(this_level[next_num] & 1)) {
@@ -27,12 +224,56 @@ static uint64_t *pagemap_traverse(uint64_t *this_level, size_t next_num, uint64_
 		r = alloc_page();
 		memset(r, 0, 4096);
 		this_level[next_num] = (((uintptr_t)r | 3) & ~hhdm_start) | (attr & (PAGE_PRESENT | PAGE_USER));
+		if (parent != NULL)
+			pt_count_add(parent, 1);
 	} else {
-		r = (void *)((this_level[next_num] & -4096ull) | hhdm_start);
+		r = (void *)((this_level[next_num] & PAGE_ADDR_MASK) | hhdm_start);
 	}
 	return r;
 }
 
+/* Map a page-aligned range, walking the upper levels of the page tables only
+ * when the range crosses into a new table, and filling each page table with a
+ * single run of entries
+ */
+static void mmap_range(uint64_t *pml4, paddr_t paddr, uintptr_t vaddr, size_t len, uint64_t attr)
+{
+	uint64_t *pdpt = NULL;
+	uint64_t *pdt = NULL;
+	uint64_t *pt;
+
+	while (len) {
+		size_t pn = (vaddr >> 12) & 0x1FF;
+		size_t ptn = (vaddr >> 21) & 0x1FF;
+		size_t pdn = (vaddr >> 30) & 0x1FF;
+		size_t pdpn = (vaddr >> 39) & 0x1FF;
+
+		if (pdpt == NULL)
+			pdpt = pagemap_traverse(pml4, NULL, pdpn, attr);
+		if (pdt == NULL)
+			pdt = pagemap_traverse(pdpt, &pml4[pdpn], pdn, attr);
+		pt = pagemap_traverse(pdt, &pdpt[pdn], ptn, attr);
+
+		size_t run = MIN(512 - pn, len >> 12);
+		int64_t added = 0;
+		for (size_t i = 0; i < run; i++, paddr += 4096) {
+			added += (attr & PAGE_PRESENT) - (pt[pn + i] & PAGE_PRESENT);
+			pt[pn + i] = paddr | attr;
+		}
+		pt_count_add(&pdt[ptn], added);
+
+		vaddr += run << 12;
+		len -= run << 12;
+
+		/* only re-walk the levels whose index changed */
+		if (((vaddr >> 21) & 0x1FF) == 0) {
+			pdt = NULL;
+			if (((vaddr >> 30) & 0x1FF) == 0)
+				pdpt = NULL;
+		}
+	}
+}
+
 uintptr_t mmap_find_unmapped(struct rbtree *tree, spinlock_t *lock, uintptr_t start, size_t len)
 {
 	bool kern = len >= hhdm_start;
@@ -84,15 +325,6 @@ uintptr_t mmap_find_unmapped(struct rbtree *tree, spinlock_t *lock, uintptr_t st
 
 void mmap(uintptr_t pml4, struct rbtree *tree, paddr_t paddr, uintptr_t vaddr, size_t len, uint64_t attr)
 {
-	uint64_t *pdpt;
-	uint64_t *pdt;
-	uint64_t *pt;
-
-	size_t pdpn;
-	size_t pdn;
-	size_t ptn;
-	size_t pn;
-
 	len += paddr & 4095;
 	paddr &= -4096ull;
 	vaddr &= -4096ull;
@@ -118,17 +350,7 @@ void mmap(uintptr_t pml4, struct rbtree *tree, paddr_t paddr, uintptr_t vaddr, s
 		node->value3 = attr;
 	}
 
-	for (; len; len -= 4096, vaddr += 4096, paddr += 4096) {
-		pn = (vaddr >> 12) & 0x1FF;
-		ptn = (vaddr >> 21) & 0x1FF;
-		pdn = (vaddr >> 30) & 0x1FF;
-		pdpn = (vaddr >> 39) & 0x1FF;
-
-		pdpt = pagemap_traverse((uint64_t *)pml4, pdpn, attr);
-		pdt = pagemap_traverse(pdpt, pdn, attr);
-		pt = pagemap_traverse(pdt, ptn, attr);
-		pt[pn] = paddr | attr;
-	}
+	mmap_range((uint64_t *)pml4, paddr, vaddr, len, attr);
 }
 
 void *proc_mmap(struct proc *proc, paddr_t paddr, uintptr_t vaddr, size_t len, uint64_t attr)
@@ -163,9 +385,7 @@ void kmap(paddr_t paddr, uintptr_t vaddr, size_t len, uint64_t attr)
 	mmap((uintptr_t)pml4, kmap_tree, paddr, vaddr, len, attr);
 	spinlock_release(&kmap_lock);
 
-	/* flush TLB */
-	uint64_t cr3 = cr3_read();
-	cr3_write(cr3);
+	tlb_flush_all();
 }
 
 void *kmap_device(void *dev_paddr, size_t len)
@@ -179,19 +399,82 @@ void *kmap_device(void *dev_paddr, size_t len)
 	return (void *)vaddr;
 }
 
-static bool munmap_check_table(uint64_t *table, uint64_t *parent, size_t n)
+/* Unmap a page-aligned range. Each page table is cleared with a single run of
+ * stores, and tables left empty are found through the occupancy count in their
+ * parent entry and handed to the page table cache in one batch at the end
+ */
+static void munmap_range(uint64_t *pml4, uintptr_t vaddr, size_t len)
 {
-	for (size_t i = 0; i < 512; i++) {
-		if (table[i] & 1) {
-			return false;
+	struct pt_batch batch = { NULL, NULL, 0 };
+	struct pt_batch kbatch = { NULL, NULL, 0 };
+	uintptr_t start = vaddr;
+	size_t pages = len >> 12;
+	size_t unmapped = 0;
+
+	while (len) {
+		size_t pn = (vaddr >> 12) & 0x1FF;
+		size_t ptn = (vaddr >> 21) & 0x1FF;
+		size_t pdn = (vaddr >> 30) & 0x1FF;
+		size_t pdpn = (vaddr >> 39) & 0x1FF;
+
+		size_t run = MIN(512 - pn, len >> 12);
+
+		vaddr += run << 12;
+		len -= run << 12;
+
+		uint64_t *pdpt = pagemap_traverse(pml4, NULL, pdpn, 0);
+		if (pdpt == NULL)
+			continue;
+		uint64_t *pdt = pagemap_traverse(pdpt, &pml4[pdpn], pdn, 0);
+		if (pdt == NULL)
+			continue;
+		uint64_t *pt = pagemap_traverse(pdt, &pdpt[pdn], ptn, 0);
+		if (pt == NULL)
+			continue;
+
+		int64_t removed = 0;
+		for (size_t i = 0; i < run; i++) {
+			removed += pt[pn + i] & PAGE_PRESENT;
+			pt[pn + i] = 0;
 		}
+		pt_count_add(&pdt[ptn], -removed);
+		unmapped += removed;
+
+		struct pt_batch *b = pdpn >= 256 ? &kbatch : &batch;
+
+		if (pt_count(pdt[ptn]))
+			continue;
+		pdt[ptn] = 0;
+		pt_count_add(&pdpt[pdn], -1);
+		pt_batch_add(b, pt);
+
+		if (pt_count(pdpt[pdn]))
+			continue;
+		pdpt[pdn] = 0;
+		pt_count_add(&pml4[pdpn], -1);
+		pt_batch_add(b, pdt);
+
+		/* higher half PDPTs are shared by every copy of the kernel PML4 */
+		if (pt_count(pml4[pdpn]) || pdpn >= 256)
+			continue;
+		pml4[pdpn] = 0;
+		pt_batch_add(b, pdpt);
 	}
-	slab_free(page_slab, table);
 
-	if (parent != NULL)
-		parent[n] = 0;
+	/* the MMU of this CPU may still hold the pages and tables if the map is live */
+	if ((cr3_read() & PAGE_ADDR_MASK) == ((uintptr_t)pml4 & ~hhdm_start)) {
+		if (batch.head != NULL || kbatch.head != NULL || (unmapped && pages > TLB_INVLPG_MAX)) {
+			tlb_flush_all();
+		} else if (unmapped) {
+			for (size_t i = 0; i < pages; i++)
+				invlpg(start + (i << 12));
+		}
+	}
 
-	return true;
+	if (batch.head != NULL)
+		pt_cache_put(&batch);
+	if (kbatch.head != NULL)
+		pt_defer(&kbatch);
 }
 
 void munmap(struct rbtree *map_tree, uintptr_t vaddr, uintptr_t pml4_vaddr)
@@ -199,15 +482,6 @@ void munmap(struct rbtree *map_tree, uintptr_t vaddr, uintptr_t pml4_vaddr)
 	if (kmap_tree == NULL)
 		return;
 
-	uint64_t *pdpt;
-	uint64_t *pdt;
-	uint64_t *pt;
-
-	size_t pdpn;
-	size_t pdn;
-	size_t ptn;
-	size_t pn;
-
 	struct rbnode *node = rbt_search(map_tree, vaddr);
 
 	if (node == NULL) {
@@ -215,26 +489,7 @@ void munmap(struct rbtree *map_tree, uintptr_t vaddr, uintptr_t pml4_vaddr)
 		return;
 	}
 
-	size_t len = node->value2;
-
-	for (; len; len -= 4096, vaddr += 4096) {
-		pn = (vaddr >> 12) & 0x1FF;
-		ptn = (vaddr >> 21) & 0x1FF;
-		pdn = (vaddr >> 30) & 0x1FF;
-		pdpn = (vaddr >> 39) & 0x1FF;
-
-		pdpt = pagemap_traverse((uint64_t *)pml4_vaddr, pdpn, 0);
-		pdt = pagemap_traverse(pdpt, pdn, 0);
-		pt = pagemap_traverse(pdt, ptn, 0);
-		pt[pn] = 0;
-
-		if (!munmap_check_table(pt, pdt, ptn))
-			continue;
-		if (!munmap_check_table(pdt, pdpt, pdn))
-			continue;
-
-		munmap_check_table(pdpt, (uint64_t *)pml4, pdpn);
-	}
+	munmap_range((uint64_t *)pml4_vaddr, vaddr, node->value2);
 
 	rbt_delete(map_tree, node);
 }
@@ -304,17 +559,17 @@ paddr_t virt_to_phys(uintptr_t vaddr, paddr_t page_base)
 	size_t pdpn = (vaddr >> 39) & 0x1FF;
 
 	uint64_t *cur = (uint64_t *)(page_base | hhdm_start);
-	cur = (uint64_t *)((cur[pdpn] & -4096ull) | hhdm_start);
-	cur = (uint64_t *)((cur[pdn] & -4096ull) | hhdm_start);
-	cur = (uint64_t *)((cur[ptn] & -4096ull) | hhdm_start);
-	cur = (uint64_t *)((cur[pn] & -4096ull));
+	cur = (uint64_t *)((cur[pdpn] & PAGE_ADDR_MASK) | hhdm_start);
+	cur = (uint64_t *)((cur[pdn] & PAGE_ADDR_MASK) | hhdm_start);
+	cur = (uint64_t *)((cur[ptn] & PAGE_ADDR_MASK) | hhdm_start);
+	cur = (uint64_t *)((cur[pn] & PAGE_ADDR_MASK));
 
 	return (paddr_t)cur & (~hhdm_start);
 }
 
 void page_init(paddr_t kpaddr, uintptr_t kvaddr, size_t kernel_size, struct mem_region *regions, size_t num_regions)
 {
-	page_slab = slab_create(0x1000, 4 * MB, SLAB_PAGE_ALIGN);
+	pgtable_cache = kmem_cache_create("pgtable", 0x1000, 0, SLAB_PAGE_ALIGN, NULL);
 
 	/* this inits kmalloc */
 	slabtypes_init();
@@ -341,6 +596,8 @@ void page_init(paddr_t kpaddr, uintptr_t kvaddr, size_t kernel_size, struct mem_
 
 	cr3_write(kcr3);
 
+	shrinker_register(&pt_cache_shrinker);
+
 	/* done */
 	kprintf(LOG_SUCCESS "Paging initialized\n");
 }
@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <kernel/common.h>
+#include <kernel/mem.h>
+#include <kernel/lock.h>
+#include <kernel/atomic.h>
+#include <kernel/proc.h>
+#include <kernel/wait.h>
+#include <kernel/reclaim.h>
+
+#define RECLAIM_BATCH 32
+
+/* watermarks in pages, set once the amount of memory is known */
+size_t reclaim_wmark_low = 0;
+size_t reclaim_wmark_high = 0;
+
+static struct shrinker *shrinkers = NULL;
+static spinlock_t shrinkers_lock = 0;
+
+static uint64_t reclaim_running = 0;
+static volatile bool reclaim_wanted = false;
+static waitq_t reclaim_wq;
+
+void shrinker_register(struct shrinker *shrinker)
+{
+	spinlock_acquire(&shrinkers_lock);
+	shrinker->next = shrinkers;
+	shrinkers = shrinker;
+	spinlock_release(&shrinkers_lock);
+}
+
+/* Walk the shrinkers in batches until nr_pages have come back to the buddy
+ * allocator or no shrinker can make progress. Returns the number of pages that
+ * were freed in the meantime.
+ */
+size_t reclaim_pages(size_t nr_pages)
+{
+	/* shrinkers free memory, which must never recurse into reclaim */
+	if (test_and_set_bit(0, &reclaim_running))
+		return 0;
+
+	size_t start = buddy_free_pages;
+	bool progress = true;
+
+	while (progress && buddy_free_pages < start + nr_pages) {
+		progress = false;
+
+		for (struct shrinker *s = shrinkers; s != NULL; s = s->next) {
+			if (s->count() == 0)
+				continue;
+
+			if (s->scan(RECLAIM_BATCH))
+				progress = true;
+
+			if (buddy_free_pages >= start + nr_pages)
+				break;
+		}
+	}
+
+	clear_bit(0, &reclaim_running);
+
+	return buddy_free_pages > start ? buddy_free_pages - start : 0;
+}
+
+void reclaim_wakeup()
+{
+	if (reclaim_wanted)
+		return;
+
+	reclaim_wanted = true;
+	waitq_wake_one(&reclaim_wq);
+}
+
+/* background reclaimer: once woken below the low watermark, shrink the caches
+ * until the high watermark is reached again
+ */
+static void kreclaimd()
+{
+	sti();
+
+	while (1) {
+		wait_event(&reclaim_wq, reclaim_wanted);
+		reclaim_wanted = false;
+
+		if (buddy_free_pages < reclaim_wmark_high)
+			reclaim_pages(reclaim_wmark_high - buddy_free_pages);
+	}
+}
+
+void reclaim_init()
+{
+	reclaim_wmark_low = MAX(buddy_total_pages / 128, 256ull);
+	reclaim_wmark_high = reclaim_wmark_low * 2;
+
+	waitq_init(&reclaim_wq);
+
+	proc_create_kthread(kreclaimd);
+
+#ifdef KDEBUG
+	kprintf(LOG_DEBUG "Reclaim watermarks: low=%d high=%d pages\n", reclaim_wmark_low, reclaim_wmark_high);
+#endif
+}
@@ -4,142 +4,244 @@
 #include <kernel/rbtree.h>
 #include <kernel/slab.h>
 #include <kernel/proc.h>
-
-#define SLAB_ALIGN 7
-
-#define KMT_DMA 0xDE11A000
+#include <kernel/trace.h>
+#include <fs/devfs.h>
 
 static size_t slab_sizes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048, 4096 };
-static slab_t *kslab_cache[ARRAY_SIZE(slab_sizes)];
-static size_t dma_sizes[] = { 0x1000, 0x10000, 0x100000, 0x1000000 };
-static slab_t *slab_cache_dma[ARRAY_SIZE(slab_sizes)];
+static struct kmem_cache *kslab_cache[ARRAY_SIZE(slab_sizes)];
+/* Larger DMA buffers come straight from buddy_alloc: the 64K aligned slab
+ * header would cost a whole object of every slab, and a slab of them pins
+ * several times the size of the buffer
+ */
+static size_t dma_sizes[] = { 0x1000, 0x10000 };
+static struct kmem_cache *slab_cache_dma[ARRAY_SIZE(dma_sizes)];
 static size_t uslab_sizes[] = { 0x1000, 0x4000, 0x8000, 0x10000, 0x20000 };
-static slab_t *uslab_cache[ARRAY_SIZE(slab_sizes)];
+static struct kmem_cache *uslab_cache[ARRAY_SIZE(uslab_sizes)];
 
-static struct rbtree kmalloc_tree = { NULL, 0, 0 };
 static struct rbtree umalloc_tree = { NULL, 0, 0 };
 
-static inline void slab_range(slab_t *slab, uintptr_t *o_start, uintptr_t *o_end)
-{
-	uintptr_t sslab = (uintptr_t)slab;
-	sslab = (sslab | slab->align) + 1;
+/* the cache that kmem_cache structures themselves are allocated from */
+static struct kmem_cache cache_cache = {
+	.name = "kmem_cache",
+	.obj_size = sizeof(struct kmem_cache),
+	.size = (sizeof(struct kmem_cache) + CACHELINE_SIZE - 1) & ~(CACHELINE_SIZE - 1),
+	.align = CACHELINE_SIZE,
+	.slab_size = 16 * KB,
+};
 
-	*o_start = sslab;
-	*o_end = sslab + (slab->size * slab->num);
-}
+static struct kmem_cache *kmem_caches = &cache_cache;
+static spinlock_t kmem_caches_lock = 0;
 
-slab_t *slab_create(size_t size, size_t cache_size, uint64_t flags)
+static slab_t *slab_create(struct kmem_cache *cache)
 {
-	if (size < sizeof(uintptr_t))
-		return NULL;
-
-	slab_t *ret = buddy_alloc(cache_size);
+	slab_t *ret = buddy_alloc(cache->slab_size);
 	if (ret == NULL)
 		return NULL;
 
-	cache_size = npow2(cache_size);
-
-	/* slab area start position */
-
-	uintptr_t aret = (uintptr_t)ret;
-	uintptr_t start = (uintptr_t)ret + sizeof(slab_t);
-
-	if (flags & SLAB_PAGE_ALIGN) {
-		ret->align = 0xFFF;
-	} else if (flags & SLAB_DMA_64K) {
-		ret->align = 0xFFFF;
+	if (cache->flags & SLAB_DMA_64K) {
 		struct page attrs = kdefault_attrs;
 		attrs.pcd = 1;
-		kmap((paddr_t)(ret) & (~hhdm_start), (paddr_t)ret, cache_size, attrs.val);
-	} else {
-		ret->align = SLAB_ALIGN;
+		kmap((paddr_t)(ret) & (~hhdm_start), (paddr_t)ret, cache->slab_size, attrs.val);
 	}
 
-	start -= 1;
-	start |= ret->align;
-	start += 1;
+	uintptr_t aret = (uintptr_t)ret;
+	uintptr_t start = (aret + sizeof(slab_t) + cache->align - 1) & ~(cache->align - 1);
 
-	ret->num = (((aret + cache_size) - start) / size);
-	ret->size = size;
-	ret->tsize = cache_size;
+	/* Offset each new slab by a different multiple of the cache line size so
+	 * objects at the same index don't all compete for the same cache sets
+	 */
+	struct mcs_node node;
+	mcs_acquire(&cache->lock, &node);
+	size_t colour = cache->colour_next;
+	cache->colour_next += MAX(cache->align, (size_t)CACHELINE_SIZE);
+	if (cache->colour_next > cache->colour_max)
+		cache->colour_next = 0;
+	mcs_release(&cache->lock, &node);
+
+	start += colour;
+
+	ret->num = ((aret + cache->slab_size) - start) / cache->size;
+	ret->tsize = cache->slab_size;
+	ret->colour = colour;
 	ret->next = NULL;
 	ret->prev = NULL;
-	ret->flags = flags;
+	ret->cache = cache;
 	ret->nextfree = (uintptr_t *)start;
 	ret->free = ret->num;
-	ret->lock = 0;
 
 	uintptr_t *ptr = (uintptr_t *)start;
 	for (size_t i = 0; i < ret->num; i++) {
-		*ptr = (uintptr_t)ptr + size;
+		*ptr = (uintptr_t)ptr + cache->size;
 		if (i == ret->num - 1)
 			*ptr = 0;
 		ptr = (uintptr_t *)*ptr;
 	}
 
+	page_frames_set(ret, cache->slab_size, PF_SLAB, ret);
+
 	return ret;
 }
 
-void *slab_alloc(slab_t *slab)
+static void slab_destroy(slab_t *slab)
 {
-	if (slab == NULL)
+	struct kmem_cache *cache = slab->cache;
+
+	if (cache->flags & SLAB_DMA_64K) {
+		struct page attrs = kdefault_attrs;
+		attrs.pcd = 0;
+		kmap((paddr_t)slab & (~hhdm_start), (paddr_t)slab, slab->tsize, attrs.val);
+	}
+
+	page_frames_set(slab, slab->tsize, 0, NULL);
+	buddy_free(slab);
+}
+
+/* Pick the size of each slab in the cache: room for at least 64 objects where
+ * that stays below 4M, and never less than 16K
+ */
+static size_t kmem_cache_slab_size(struct kmem_cache *cache)
+{
+	size_t header = (sizeof(slab_t) + cache->align - 1) & ~(cache->align - 1);
+	size_t want = MIN(cache->size * 64, 4 * MB);
+
+	want = MAX(want, header + cache->size);
+	want = MAX(want, 16 * KB);
+
+	return npow2(want);
+}
+
+/* Create a named object cache
+ *
+ * align must be a power of two, 0 selects the default of 8 bytes. SLAB_HWCACHE_ALIGN
+ * aligns objects to a cache line, SLAB_PAGE_ALIGN and SLAB_DMA_64K to a page and
+ * a 64K boundary. ctor, if given, is run on every object returned by
+ * kmem_cache_alloc.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, uint64_t flags, void (*ctor)(void *))
+{
+	if (size < sizeof(uintptr_t))
+		size = sizeof(uintptr_t);
+
+	if (align == 0)
+		align = 8;
+	if (flags & SLAB_HWCACHE_ALIGN)
+		align = MAX(align, (size_t)CACHELINE_SIZE);
+	if (flags & SLAB_PAGE_ALIGN)
+		align = MAX(align, (size_t)0x1000);
+	if (flags & SLAB_DMA_64K)
+		align = MAX(align, (size_t)0x10000);
+
+	struct kmem_cache *cache = kmem_cache_alloc(&cache_cache);
+	if (cache == NULL)
 		return NULL;
 
-	spinlock_t *lock = &slab->lock;
-	spinlock_acquire(lock);
-	if (slab->nextfree == NULL) {
-		if (slab->next == NULL) {
-			slab->next = slab_create(slab->size, slab->tsize, slab->flags);
-			if (slab->next == NULL) {
-				spinlock_release(lock);
-				return NULL;
-			}
-			slab->next->prev = slab;
-		}
+	memset(cache, 0, sizeof(struct kmem_cache));
+	cache->name = name;
+	cache->obj_size = size;
+	cache->size = (size + align - 1) & ~(align - 1);
+	cache->align = align;
+	cache->flags = flags;
+	cache->ctor = ctor;
+	cache->slab_size = kmem_cache_slab_size(cache);
+
+	/* whatever is left over at the end of a slab is used for colouring */
+	size_t header = (sizeof(slab_t) + align - 1) & ~(align - 1);
+	size_t leftover = (cache->slab_size - header) % cache->size;
+	cache->colour_max = leftover & ~((size_t)CACHELINE_SIZE - 1);
+
+	spinlock_acquire(&kmem_caches_lock);
+	cache->next = kmem_caches;
+	kmem_caches = cache;
+	spinlock_release(&kmem_caches_lock);
+
+	return cache;
+}
 
-		void *ret = slab_alloc(slab->next);
-		spinlock_release(lock);
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+	if (cache == NULL)
+		return NULL;
+
+	mcs_lock_t *lock = &cache->lock;
+	struct mcs_node node;
+	mcs_acquire(lock, &node);
+
+	slab_t *cur = cache->slabs;
+	while (cur != NULL && cur->nextfree == NULL && cur->next != NULL)
+		cur = cur->next;
 
-		return ret;
+	if (cur == NULL || cur->nextfree == NULL) {
+		/* The lock is dropped while growing the chain: buddy_alloc may reclaim
+		 * memory, and the shrinkers free objects back into caches
+		 */
+		mcs_release(lock, &node);
+
+		slab_t *new = slab_create(cache);
+		if (new == NULL)
+			return NULL;
+
+		/* cur may have been emptied and released in the meantime */
+		mcs_acquire(lock, &node);
+		cache->num_slabs++;
+
+		cur = cache->slabs;
+		if (cur == NULL) {
+			cache->slabs = new;
+		} else {
+			while (cur->next != NULL)
+				cur = cur->next;
+
+			cur->next = new;
+			new->prev = cur;
+		}
+
+		cur = new;
 	}
 
-	slab->free--;
-	uintptr_t *ret = slab->nextfree;
-	slab->nextfree = (uintptr_t *)*slab->nextfree;
+	cur->free--;
+	uintptr_t *ret = cur->nextfree;
+	cur->nextfree = (uintptr_t *)*cur->nextfree;
 
-	spinlock_release(lock);
+	cache->allocs++;
+	cache->active++;
 
+	mcs_release(lock, &node);
+
+	if (cache->ctor)
+		cache->ctor(ret);
+
+	trace(TRACE_SLAB_ALLOC, cache->obj_size, ret);
 	return ret;
 }
 
-void slab_free(slab_t *slab, void *ptr)
+void kmem_cache_free(struct kmem_cache *cache, void *ptr)
 {
-	if (slab == NULL)
+	if (cache == NULL)
 		return;
 	if (ptr == NULL)
 		return;
 
-	uintptr_t low = 0;
-	uintptr_t high = 0;
+	/* the frame knows which slab of the cache the object belongs to */
+	struct page_frame *frame = virt_to_frame(ptr);
+	if (frame == NULL || !(frame->flags & PF_SLAB) || frame->slab->cache != cache) {
+		kprintf(LOG_ERROR "slab: invalid free: %X\n", ptr);
+		return;
+	}
 
-	spinlock_t *lock = &slab->lock;
-	spinlock_acquire(lock);
+	mcs_lock_t *lock = &cache->lock;
+	struct mcs_node node;
+	mcs_acquire(lock, &node);
 
-	slab_range(slab, &low, &high);
-	while ((uintptr_t)ptr < low || (uintptr_t)ptr > high) {
-		slab_range(slab, &low, &high);
-		slab = slab->next;
-		if (slab == NULL) {
-			spinlock_release(lock);
-			return;
-		}
-	}
+	slab_t *slab = frame->slab;
 
 	*(uintptr_t *)ptr = (uintptr_t)slab->nextfree;
 	slab->nextfree = ptr;
 	slab->free++;
 
-	/* delete the slab if it's empty and not a root slab */
+	cache->frees++;
+	cache->active--;
+
+	/* delete the slab if it's empty and not the first slab */
 	if (slab->free == slab->num && slab->prev != NULL) {
 		slab_t *next = slab->next;
 		slab_t *prev = slab->prev;
@@ -148,29 +250,79 @@ void slab_free(slab_t *slab, void *ptr)
 		if (next != NULL)
 			next->prev = prev;
 
-		if (slab->flags & SLAB_DMA_64K) {
-			struct page attrs = kdefault_attrs;
-			attrs.pcd = 0;
-			kmap((paddr_t)slab & (~hhdm_start), (paddr_t)slab, slab->tsize, attrs.val);
-		}
+		cache->num_slabs--;
+		mcs_release(lock, &node);
 
-		buddy_free(slab);
+		slab_destroy(slab);
+		return;
 	}
 
-	spinlock_release(lock);
+	mcs_release(lock, &node);
 }
 
+/* /dev/slabinfo: one line per cache */
+static ssize_t slabinfo_read(void *dev, void *buf, size_t offset, size_t size)
+{
+	(void)dev;
+
+	size_t ncaches = 0;
+	for (struct kmem_cache *c = kmem_caches; c != NULL; c = c->next)
+		ncaches++;
+
+	const size_t line_max = 160;
+	size_t buf_len = (ncaches + 1) * line_max;
+	char *text = kmalloc(buf_len, ALLOC_KERN);
+	if (text == NULL)
+		return -ENOMEM;
+
+	size_t len = snprintf(text, "# name active objsize objperslab slabs allocs frees\n", line_max);
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (struct kmem_cache *c = kmem_caches; c != NULL && len + line_max <= buf_len; c = c->next) {
+		size_t per_slab = (c->slab_size - ((sizeof(slab_t) + c->align - 1) & ~(c->align - 1))) / c->size;
+
+		len += snprintf(text + len, "%s %d %d %d %d %d %d\n", line_max, c->name, (int)c->active, (int)c->obj_size,
+				(int)per_slab, (int)c->num_slabs, (int)c->allocs, (int)c->frees);
+	}
+	spinlock_release(&kmem_caches_lock);
+
+	ssize_t ret = 0;
+	if (offset < len) {
+		ret = MIN(size, len - offset);
+		memcpy(buf, text + offset, ret);
+	}
+
+	kfree(text);
+
+	return ret;
+}
+
+static ssize_t slabinfo_write(void *dev, void *buf, size_t offset, size_t size)
+{
+	return -EINVAL;
+}
+
+struct devfs_dev_info slabinfo_dev_info = {
+	.dev = NULL,
+	.read = slabinfo_read,
+	.write = slabinfo_write,
+};
+
 void kmalloc_init()
 {
+	static const char *names[] = { "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+				       "kmalloc-512", "kmalloc-1k", "kmalloc-2k", "kmalloc-4k" };
+	static const char *dma_names[] = { "dma-4k", "dma-64k" };
+
 	for (size_t i = 0; i < ARRAY_SIZE(slab_sizes); i++)
-		kslab_cache[i] = slab_create(slab_sizes[i], 128 * KB, 0);
+		kslab_cache[i] = kmem_cache_create(names[i], slab_sizes[i], 0, 0, NULL);
 	for (size_t i = 0; i < ARRAY_SIZE(dma_sizes); i++)
-		slab_cache_dma[i] = slab_create(dma_sizes[i], 8 * MB, SLAB_DMA_64K);
+		slab_cache_dma[i] = kmem_cache_create(dma_names[i], dma_sizes[i], 0, SLAB_DMA_64K, NULL);
 }
 
-static void *kmalloc_table(size_t size, size_t *sizes, size_t nsizes, slab_t **cache, bool fb_disable)
+static void *kmalloc_table(size_t size, size_t *sizes, size_t nsizes, struct kmem_cache **cache, bool fb_disable)
 {
-	slab_t *slab = NULL;
+	struct kmem_cache *slab = NULL;
 	void *ret = NULL;
 	if (size > sizes[nsizes - 1] && !fb_disable) {
 		ret = buddy_alloc(npow2(size));
@@ -179,26 +331,12 @@ static void *kmalloc_table(size_t size, size_t *sizes, size_t nsizes, slab_t **c
 			if (size <= sizes[i]) {
 				size = sizes[i];
 				slab = cache[i];
-				ret = slab_alloc(slab);
+				ret = kmem_cache_alloc(slab);
 				break;
 			}
 		}
 	}
 
-	if (ret == NULL)
-		return NULL;
-
-	struct rbnode *n = rbt_insert(&kmalloc_tree, (uint64_t)ret);
-	if (n == NULL) {
-		if (slab != NULL)
-			slab_free(slab, ret);
-		else
-			buddy_free(ret);
-		return NULL;
-	}
-	n->value = (uint64_t)slab;
-	n->value2 = size;
-
 	return ret;
 }
 
@@ -209,19 +347,17 @@ void *kmalloc(size_t size, uint64_t flags)
 	if (flags & ALLOC_DMA) {
 		ret = kmalloc_table(size, dma_sizes, ARRAY_SIZE(dma_sizes), slab_cache_dma, true);
 		if (ret == NULL) {
-			ret = buddy_alloc(npow2(size));
+			size = npow2(size);
+			ret = buddy_alloc(size);
 			if (ret == NULL)
 				return NULL;
 
-			struct rbnode *n = rbt_insert(&kmalloc_tree, (uint64_t)ret);
-			if (n == NULL) {
-				buddy_free(ret);
-				return NULL;
-			}
+			/* uncached like the DMA slabs, kfree maps it back */
+			struct page attrs = kdefault_attrs;
+			attrs.pcd = 1;
+			kmap((paddr_t)ret & (~hhdm_start), (paddr_t)ret, size, attrs.val);
 
-			n->value = 0;
-			n->value2 = size;
-			n->value3 = KMT_DMA;
+			virt_to_frame(ret)->flags |= PF_DMA;
 		}
 
 	} else {
@@ -241,6 +377,22 @@ void *kzalloc(size_t size, uint64_t flags)
 	return ret;
 }
 
+/* usable size of a kmalloc allocation, 0 if ptr was not allocated by kmalloc */
+static size_t kmalloc_size(void *ptr)
+{
+	struct page_frame *frame = virt_to_frame(ptr);
+	if (frame == NULL)
+		return 0;
+
+	if (frame->flags & PF_SLAB)
+		return frame->slab->cache->size;
+
+	if ((frame->flags & PF_BUDDY) && ((uintptr_t)ptr & 0xFFF) == 0)
+		return 0x1000ull << frame->order;
+
+	return 0;
+}
+
 void *krealloc(void *ptr, size_t size, uint64_t flags)
 {
 	/* invalid case 1: ptr is NULL */
@@ -253,14 +405,13 @@ void *krealloc(void *ptr, size_t size, uint64_t flags)
 	}
 
 	/* invalid case 3: ptr is not allocated by kmalloc */
-	struct rbnode *n = rbt_search(&kmalloc_tree, (uint64_t)ptr);
-	if (n == NULL) {
+	size_t old_size = kmalloc_size(ptr);
+	if (old_size == 0) {
 		kprintf(LOG_ERROR "kmalloc: invalid realloc: %X\n", ptr);
 		return NULL;
 	}
 
 	/* invalid case 4: size is smaller than the original size */
-	size_t old_size = n->value2;
 	if (size <= old_size)
 		return ptr;
 
@@ -280,25 +431,23 @@ void kfree(void *ptr)
 	if (ptr == NULL)
 		return;
 
-	struct rbnode *n = rbt_search(&kmalloc_tree, (uint64_t)ptr);
-	if (n == NULL) {
-		kprintf(LOG_ERROR "kmalloc: invalid free: %X\n", ptr);
-		return;
-	}
+	struct page_frame *frame = virt_to_frame(ptr);
+
+	if (frame != NULL && (frame->flags & PF_SLAB)) {
+		kmem_cache_free(frame->slab->cache, ptr);
+	} else if (frame != NULL && (frame->flags & PF_BUDDY) && ((uintptr_t)ptr & 0xFFF) == 0) {
+		bool dma = frame->flags & PF_DMA;
+		size_t size = 0x1000ull << frame->order;
 
-	slab_t *slab = (slab_t *)n->value;
-	if (slab != NULL) {
-		slab_free(slab, ptr);
-	} else {
 		buddy_free(ptr);
 
-		if (n->value3 == KMT_DMA) {
+		if (dma) {
 			uintptr_t p = (uintptr_t)ptr;
-			kmap(p & (~hhdm_start), p, n->value2, kdefault_attrs.val);
+			kmap(p & (~hhdm_start), p, size, kdefault_attrs.val);
 		}
+	} else {
+		kprintf(LOG_ERROR "kmalloc: invalid free: %X\n", ptr);
 	}
-
-	rbt_delete(&kmalloc_tree, n);
 }
 
 void ufree(struct proc *proc, void *addr)
@@ -318,7 +467,7 @@ void ufree(struct proc *proc, void *addr)
 			buddy_free((void *)(m->paddr | hhdm_start));
 			proc_munmap(proc, m->vaddr);
 		} else if (m->type == PM_SLB) {
-			slab_free(m->slab, (void *)(m->paddr | hhdm_start));
+			kmem_cache_free(m->cache, (void *)(m->paddr | hhdm_start));
 			proc_munmap(proc, m->vaddr);
 		}
 
@@ -438,12 +587,12 @@ void *umalloc(struct proc *proc, size_t size, uint64_t opts, uintptr_t req_addr)
 				}
 			}
 
-			void *ret = slab_alloc(uslab_cache[this_index]);
+			void *ret = kmem_cache_alloc(uslab_cache[this_index]);
 			m->type = PM_SLB;
 			m->vaddr = vaddr + total_alloc;
 			m->paddr = ((paddr_t)(ret) & (~hhdm_start));
 			m->len = this_size;
-			m->slab = uslab_cache[this_index];
+			m->cache = uslab_cache[this_index];
 			m->attr = attr;
 
 			proc_mmap(proc, m->paddr, m->vaddr, m->len, attr);
@@ -463,8 +612,10 @@ void *umalloc(struct proc *proc, size_t size, uint64_t opts, uintptr_t req_addr)
 
 static void umalloc_init()
 {
+	static const char *names[] = { "umalloc-4k", "umalloc-16k", "umalloc-32k", "umalloc-64k", "umalloc-128k" };
+
 	for (size_t i = 0; i < ARRAY_SIZE(uslab_sizes); i++)
-		uslab_cache[i] = slab_create(uslab_sizes[i], 4 * MB, SLAB_PAGE_ALIGN);
+		uslab_cache[i] = kmem_cache_create(names[i], uslab_sizes[i], 0, SLAB_PAGE_ALIGN, NULL);
 }
 
 void slabtypes_init()
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <kernel/common.h>
+#include <kernel/clock.h>
+#include <kernel/cpufeature.h>
+#include <kernel/msr.h>
+
+/* Monotonic clock in nanoseconds since boot, read from the TSC
+ *
+ * Cycles are converted with a multiply and a shift instead of a division:
+ * ns = cycles * clock_mult >> CLOCK_SHIFT. The product is kept in 128 bits so
+ * the clock doesn't wrap for as long as the TSC doesn't.
+ */
+#define CLOCK_SHIFT 32
+
+static uint64_t clock_mult = 0;
+static uint64_t clock_tsc_hz = 0;
+static uint64_t clock_tsc_base = 0;
+
+void clock_init(uint64_t tsc_hz)
+{
+	if (!boot_cpu_has(CPU_FEATURE_INVARIANT_TSC))
+		kprintf(LOG_WARN "clock: TSC is not invariant, the clock may drift with frequency changes\n");
+
+	clock_tsc_hz = tsc_hz;
+	clock_mult = (NSEC_PER_SEC << CLOCK_SHIFT) / tsc_hz;
+	clock_tsc_base = rdtsc();
+
+	kprintf(LOG_SUCCESS "clock: TSC running at %d kHz\n", (int)(tsc_hz / 1000));
+}
+
+uint64_t clock_ns()
+{
+	uint64_t cycles = rdtsc() - clock_tsc_base;
+	return ((unsigned __int128)cycles * clock_mult) >> CLOCK_SHIFT;
+}
+
+uint64_t clock_ns_to_cycles(uint64_t ns)
+{
+	/* split so that neither product overflows */
+	uint64_t sec = ns / NSEC_PER_SEC;
+	uint64_t rem = ns % NSEC_PER_SEC;
+
+	return sec * clock_tsc_hz + rem * clock_tsc_hz / NSEC_PER_SEC;
+}
@@ -0,0 +1,226 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <kernel/common.h>
+#include <kernel/fpu.h>
+#include <kernel/cpuid.h>
+#include <kernel/cpufeature.h>
+#include <kernel/lock.h>
+#include <kernel/percpu.h>
+#include <kernel/proc.h>
+#include <kernel/slab.h>
+
+/* Extended state of processes: x87, SSE and AVX if the CPU has it
+ *
+ * Restoring is lazy. CR0.TS is set whenever the registers don't hold the state
+ * of the running process, so its first FPU instruction raises #NM and
+ * fpu_trap loads the state. A process that doesn't touch the FPU during a
+ * timeslice costs nothing.
+ *
+ * Saving is eager. A process that had its state loaded is saved when it is
+ * switched out, so its saved state is always current once it can run on
+ * another CPU. The registers stay loaded, and if the process comes back to the
+ * same CPU with nobody else having used the FPU, TS is simply cleared.
+ */
+
+#define FXSAVE_SIZE 512
+#define FPU_STATE_ALIGN 64
+
+/* default control words, all exceptions masked */
+#define FPU_FCW_INIT 0x037F
+#define FPU_MXCSR_INIT 0x1F80
+
+static struct kmem_cache *fpu_cache;
+static size_t fpu_state_size = FXSAVE_SIZE;
+static bool fpu_has_xsave = false;
+static bool fpu_has_xsaveopt = false;
+static uint64_t fpu_xcr0 = XCR0_X87 | XCR0_SSE;
+
+static inline void clts()
+{
+	__asm__ volatile("clts" ::: "memory");
+}
+
+static inline void stts()
+{
+	cr0_write(cr0_read() | CR0_TS);
+}
+
+static inline void xsetbv(uint32_t reg, uint64_t val)
+{
+	__asm__ volatile("xsetbv" ::"c"(reg), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+static void fpu_save(void *state)
+{
+	if (fpu_has_xsaveopt)
+		__asm__ volatile("xsaveopt64 (%0)" ::"r"(state), "a"(-1), "d"(-1) : "memory");
+	else if (fpu_has_xsave)
+		__asm__ volatile("xsave64 (%0)" ::"r"(state), "a"(-1), "d"(-1) : "memory");
+	else
+		__asm__ volatile("fxsave64 (%0)" ::"r"(state) : "memory");
+}
+
+static void fpu_restore(void *state)
+{
+	if (fpu_has_xsave)
+		__asm__ volatile("xrstor64 (%0)" ::"r"(state), "a"(-1), "d"(-1) : "memory");
+	else
+		__asm__ volatile("fxrstor64 (%0)" ::"r"(state) : "memory");
+}
+
+/* A zeroed XSAVE header marks every component as in its initial state, only
+ * the control words in the legacy area are loaded as they are
+ */
+static void fpu_state_init(void *state)
+{
+	memset(state, 0, fpu_state_size);
+	*(uint16_t *)state = FPU_FCW_INIT;
+	*(uint32_t *)(state + 24) = FPU_MXCSR_INIT;
+}
+
+/* the registers hold the live state of proc */
+static inline bool fpu_loaded(struct percpu *cpu, struct proc *proc)
+{
+	return cpu->fpu_owner == proc && proc->fpu_cpu == (int)cpu->id;
+}
+
+void fpu_switch(struct proc *prev, struct proc *next)
+{
+	struct percpu *cpu = this_cpu();
+
+	if (prev == next)
+		return;
+
+	if (prev && fpu_loaded(cpu, prev))
+		fpu_save(prev->fpu_state);
+
+	if (next && fpu_loaded(cpu, next))
+		clts();
+	else if (!(cr0_read() & CR0_TS))
+		stts();
+}
+
+/* #NM: the running process used the FPU while TS was set */
+bool fpu_trap()
+{
+	struct percpu *cpu = this_cpu();
+	struct proc *proc = cpu->curr;
+
+	if (proc == NULL || proc->pid == 0)
+		return false;
+
+	if (proc->fpu_state == NULL) {
+		proc->fpu_state = kmem_cache_alloc(fpu_cache);
+		if (proc->fpu_state == NULL)
+			return false;
+
+		fpu_state_init(proc->fpu_state);
+	}
+
+	/* whatever the registers hold was saved when its owner was switched out */
+	clts();
+	fpu_restore(proc->fpu_state);
+
+	cpu->fpu_owner = proc;
+	proc->fpu_cpu = cpu->id;
+
+	return true;
+}
+
+void fpu_fork(struct proc *parent, struct proc *child)
+{
+	if (parent->fpu_state == NULL)
+		return;
+
+	child->fpu_state = kmem_cache_alloc(fpu_cache);
+	if (child->fpu_state == NULL)
+		return;
+
+	uint64_t flags = irq_save();
+	struct percpu *cpu = this_cpu();
+	if (fpu_loaded(cpu, parent))
+		fpu_save(parent->fpu_state);
+	irq_restore(flags);
+
+	memcpy(child->fpu_state, parent->fpu_state, fpu_state_size);
+}
+
+void fpu_free(struct proc *proc)
+{
+	if (proc->fpu_state)
+		kmem_cache_free(fpu_cache, proc->fpu_state);
+}
+
+uint64_t kernel_fpu_begin()
+{
+	uint64_t flags = irq_save();
+	struct percpu *cpu = this_cpu();
+
+	clts();
+
+	/* the registers are about to be clobbered */
+	if (cpu->curr && fpu_loaded(cpu, cpu->curr))
+		fpu_save(cpu->curr->fpu_state);
+	cpu->fpu_owner = NULL;
+
+	return flags;
+}
+
+void kernel_fpu_end(uint64_t flags)
+{
+	stts();
+	irq_restore(flags);
+}
+
+/* enable the FPU and the extended state this CPU can save, TS set */
+void fpu_init_cpu()
+{
+	uint64_t cr0 = cr0_read();
+	cr0 &= ~CR0_EM;
+	cr0 |= CR0_MP | CR0_TS;
+	cr0_write(cr0);
+
+	uint64_t cr4 = cr4_read();
+	cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+	if (fpu_has_xsave)
+		cr4 |= CR4_OSXSAVE;
+	cr4_write(cr4);
+
+	if (fpu_has_xsave)
+		xsetbv(0, fpu_xcr0);
+
+	/* start from a clean state, not what the firmware left */
+	clts();
+	__asm__ volatile("fninit");
+	stts();
+}
+
+void fpu_init()
+{
+	if (!boot_cpu_has(CPU_FEATURE_FXSR)) {
+		kprintf(LOG_ERROR "fpu: FXSAVE not supported\n");
+		panic();
+	}
+
+	if (boot_cpu_has(CPU_FEATURE_XSAVE)) {
+		fpu_has_xsave = true;
+		if (boot_cpu_has(CPU_FEATURE_AVX))
+			fpu_xcr0 |= XCR0_AVX;
+
+		fpu_has_xsaveopt = boot_cpu_has(CPU_FEATURE_XSAVEOPT);
+	}
+
+	fpu_init_cpu();
+
+	/* size of the XSAVE area for the components enabled in XCR0 */
+	if (fpu_has_xsave) {
+		struct cpuid_regs regs;
+		cpuid(CPUID_LEAF_XSTATE, 0, &regs);
+		fpu_state_size = regs.ebx;
+	}
+
+	fpu_cache = kmem_cache_create("fpu_state", fpu_state_size, FPU_STATE_ALIGN, 0, NULL);
+
+#ifdef KDEBUG
+	kprintf(LOG_DEBUG "fpu: %s, %d byte state\n", fpu_has_xsave ? "xsave" : "fxsave", (int)fpu_state_size);
+#endif
+}
@@ -6,6 +6,12 @@
 #include <kernel/slab.h>
 #include <kernel/gdt.h>
 #include <kernel/pio.h>
+#include <kernel/clock.h>
+#include <kernel/rcu.h>
+#include <kernel/percpu.h>
+#include <kernel/fpu.h>
+#include <kernel/kmsg.h>
+#include <kernel/trace.h>
 
 #include <lib/sem.h>
 
@@ -13,92 +19,505 @@
 
 #include <fs/vfs.h>
 
-static slab_t *proc_slab;
-static struct rbtree *proc_tree;
-static pid_t *proc_current;
+static struct kmem_cache *proc_cache;
+
+/* Processes by PID. Lookups walk the chains under rcu_read_lock only, the
+ * writers serialize on pid_hash_lock and free processes after a grace period.
+ */
+#define PID_HASH_SIZE 256
+
+static struct proc *pid_hash[PID_HASH_SIZE] = { NULL };
+static spinlock_t pid_hash_lock = 0;
 
 static struct proc kernel_procs[256] = { 0 };
 
-void _return_to_user(struct procregs *regs, paddr_t cr3);
+/* prev_on_cpu is cleared once the CPU is off the stack it was called on */
+void _return_to_user(struct procregs *regs, paddr_t cr3, volatile bool *prev_on_cpu);
 extern uintptr_t kstacks[256];
-extern slab_t *fd_slab;
+extern struct kmem_cache *fd_cache;
 
 static pid_t pid_counter = 0;
 static pid_t kpid_counter = 0;
 
-struct procregs *proc_current_regs()
+/* Per-CPU queues of runnable processes
+ *
+ * A process is on a run queue if and only if its state is PROC_STOPPED. Every
+ * transition into or out of PROC_STOPPED goes through proc_change_state, which
+ * holds the lock of the queue the process belongs to.
+ *
+ * Queued processes are kept on a timeline ordered by virtual runtime: the time
+ * they have run, scaled down by their weight. The process that is furthest
+ * behind runs next, so each process gets CPU time in proportion to its weight.
+ */
+struct runqueue {
+	spinlock_t lock;
+	struct rbtree timeline;
+	struct rbnode *leftmost; /* cached minimum of the timeline */
+	size_t len;
+	uint64_t load; /* sum of the weights of the queued processes */
+	uint64_t min_vruntime; /* never decreases, new and waking processes start near it */
+
+	struct proc *curr;
+	bool need_resched;
+};
+
+static struct runqueue runqueues[256] = { 0 };
+static unsigned num_runqueues = 0;
+static uint8_t runqueue_cpus[256];
+
+/* A process that stopped running less than this long ago likely still has its
+ * working set in the cache of its CPU and is not stolen, unless its queue is
+ * at least SCHED_IMBALANCE long
+ */
+#define SCHED_MIGRATION_COST (500 * NSEC_PER_USEC)
+#define SCHED_IMBALANCE 4
+
+/* scheduling period, minimum timeslice and how far a waking process must be
+ * behind the running one to preempt it
+ */
+#define SCHED_LATENCY (6 * NSEC_PER_MSEC)
+#define SCHED_MIN_GRANULARITY (750 * NSEC_PER_USEC)
+#define SCHED_WAKEUP_GRANULARITY (1 * NSEC_PER_MSEC)
+
+#define NICE_0_WEIGHT 1024
+
+/* each nice level is worth about 10% of CPU time relative to its neighbours */
+static const uint32_t nice_to_weight[40] = {
+	/* -20 */ 88761, 71755, 56483, 46273, 36291,
+	/* -15 */ 29154, 23254, 18705, 14949, 11916,
+	/* -10 */ 9548,  7620,  6100,  4904,  3906,
+	/*  -5 */ 3121,  2501,  1991,  1586,  1277,
+	/*   0 */ 1024,  820,   655,   526,   423,
+	/*   5 */ 335,   272,   215,   172,   137,
+	/*  10 */ 110,   87,    70,    56,    45,
+	/*  15 */ 36,    29,    23,    18,    15,
+};
+
+static inline struct proc **pid_hash_bucket(pid_t pid)
+{
+	return &pid_hash[(uint64_t)pid % PID_HASH_SIZE];
+}
+
+static void pid_hash_insert(struct proc *proc)
+{
+	struct proc **bucket = pid_hash_bucket(proc->pid);
+
+	spinlock_acquire(&pid_hash_lock);
+	proc->pid_next = *bucket;
+	rcu_assign_pointer(*bucket, proc);
+	spinlock_release(&pid_hash_lock);
+}
+
+static void pid_hash_remove(struct proc *proc)
+{
+	spinlock_acquire(&pid_hash_lock);
+
+	struct proc **prev = pid_hash_bucket(proc->pid);
+	while (*prev != NULL && *prev != proc)
+		prev = &(*prev)->pid_next;
+
+	/* readers on proc still see the rest of the chain through pid_next */
+	if (*prev != NULL)
+		rcu_assign_pointer(*prev, proc->pid_next);
+
+	spinlock_release(&pid_hash_lock);
+}
+
+static inline struct proc *rq_proc(struct rbnode *node)
+{
+	return (struct proc *)node->value;
+}
+
+static void rq_enqueue(struct runqueue *rq, struct proc *proc)
+{
+	proc->rq_node.key = proc->vruntime;
+	proc->rq_node.value = (uintptr_t)proc;
+	rbt_link(&rq->timeline, &proc->rq_node);
+
+	if (rq->leftmost == NULL || proc->vruntime < rq->leftmost->key)
+		rq->leftmost = &proc->rq_node;
+
+	rq->len++;
+	rq->load += proc->weight;
+}
+
+static void rq_dequeue(struct runqueue *rq, struct proc *proc)
+{
+	if (rq->leftmost == &proc->rq_node)
+		rq->leftmost = rbt_successor(&proc->rq_node);
+
+	rbt_unlink(&rq->timeline, &proc->rq_node);
+
+	rq->len--;
+	rq->load -= proc->weight;
+}
+
+/* charge the time since exec_start to the virtual runtime of proc */
+static void proc_update_vruntime(struct proc *proc, uint64_t now)
 {
-	if (proc_current[lapic_idno()] == 0)
-		return &kernel_procs[lapic_idno()].regs;
+	/* never ran */
+	if (proc->exec_start == 0)
+		return;
 
-	struct rbnode *proc_node = rbt_search(proc_tree, proc_current[lapic_idno()]);
+	uint64_t delta = now - proc->exec_start;
+	proc->exec_start = now;
+	proc->vruntime += delta * NICE_0_WEIGHT / proc->weight;
+}
+
+/* A waking process keeps its vruntime if it is ahead, but can't bank more
+ * than half a period of credit from the time it slept
+ */
+static void proc_place(struct runqueue *rq, struct proc *proc)
+{
+	uint64_t min = 0;
+	if (rq->min_vruntime > SCHED_LATENCY / 2)
+		min = rq->min_vruntime - SCHED_LATENCY / 2;
+
+	proc->vruntime = MAX(proc->vruntime, min);
+}
+
+static inline uint8_t rq_cpu(struct runqueue *rq)
+{
+	return rq - runqueues;
+}
 
-	if (proc_node) {
-		struct proc *ret = (void *)proc_node->value;
+/* interrupt a CPU so that it goes through schedule, it may be idle and have
+ * its timer stopped
+ */
+static void rq_kick(struct runqueue *rq)
+{
+	if (rq_cpu(rq) != cpu_id())
+		lapic_send_ipi(rq_cpu(rq), LAPIC_TIMER_VECTOR);
+}
+
+/* wake an idle CPU to steal from a queue that has more work than its CPU */
+static void rq_kick_idle(struct runqueue *busy)
+{
+	for (unsigned i = 0; i < num_runqueues; i++) {
+		struct runqueue *rq = &runqueues[runqueue_cpus[i]];
+		if (rq != busy && rq->curr == NULL) {
+			rq_kick(rq);
+			return;
+		}
+	}
+}
 
-		return &ret->regs;
+/* ask the CPU to reschedule at its next interrupt if proc should run first */
+static void rq_check_preempt(struct runqueue *rq, struct proc *proc)
+{
+	struct proc *curr = rq->curr;
+
+	if (curr == NULL || curr->vruntime > proc->vruntime + SCHED_WAKEUP_GRANULARITY) {
+		rq->need_resched = true;
+		rq_kick(rq);
 	} else {
-		return NULL;
+		rq_kick_idle(rq);
+	}
+}
+
+/* Lock the run queue proc belongs to, which may change until its lock is held
+ *
+ * Run queue locks are taken with interrupts disabled, interrupt handlers wake
+ * processes.
+ */
+static struct runqueue *proc_rq_lock(struct proc *proc, uint64_t *flags)
+{
+	while (1) {
+		struct runqueue *rq = &runqueues[proc->cpu];
+		*flags = spinlock_acquire_irqsave(&rq->lock);
+		if (rq == &runqueues[proc->cpu])
+			return rq;
+		spinlock_release_irqrestore(&rq->lock, *flags);
 	}
 }
 
+/* called with the run queue of proc locked */
+static void __proc_change_state(struct runqueue *rq, struct proc *proc, uint8_t state)
+{
+	uint64_t now = clock_ns();
+
+	if (proc->state == PROC_RUNNING && state != PROC_RUNNING) {
+		proc_update_vruntime(proc, now);
+		proc->last_run = now;
+	} else if (proc->state != PROC_RUNNING && state == PROC_RUNNING) {
+		proc->exec_start = now;
+		proc->slice_start = now;
+	}
+
+	if (proc->state == PROC_STOPPED && state != PROC_STOPPED) {
+		rq_dequeue(rq, proc);
+	} else if (proc->state != PROC_STOPPED && state == PROC_STOPPED) {
+		if (proc->state != PROC_RUNNING) {
+			proc_place(rq, proc);
+			rq_check_preempt(rq, proc);
+		}
+
+		rq_enqueue(rq, proc);
+	}
+
+	proc->state = state;
+}
+
+static void proc_change_state(struct proc *proc, uint8_t state)
+{
+	/* the per-CPU idle processes are never queued */
+	if (proc->pid == 0) {
+		proc->state = state;
+		return;
+	}
+
+	uint64_t flags;
+	struct runqueue *rq = proc_rq_lock(proc, &flags);
+	__proc_change_state(rq, proc, state);
+	spinlock_release_irqrestore(&rq->lock, flags);
+}
+
+/* Called by sswtch_sleep once the context of the current process is saved
+ *
+ * The process blocks unless it was woken in the meantime. *woken is set before
+ * proc_wake takes the run queue lock, so checking it under that lock can't
+ * miss a wakeup.
+ */
+void proc_sleep_commit(volatile bool *woken)
+{
+	struct proc *proc = proc_current();
+	uint64_t flags;
+	struct runqueue *rq = proc_rq_lock(proc, &flags);
+
+	if (!*woken)
+		__proc_change_state(rq, proc, PROC_BLOCKED);
+
+	spinlock_release_irqrestore(&rq->lock, flags);
+}
+
+/* called by sswtch once the context of the current process is saved */
+void proc_yield_commit()
+{
+	proc_change_state(proc_current(), PROC_STOPPED);
+}
+
+/* make a process that blocked in sswtch_sleep runnable again */
+void proc_wake(struct proc *proc)
+{
+	if (proc->pid == 0)
+		return;
+
+	uint64_t flags;
+	struct runqueue *rq = proc_rq_lock(proc, &flags);
+
+	if (proc->state == PROC_BLOCKED)
+		__proc_change_state(rq, proc, PROC_STOPPED);
+
+	spinlock_release_irqrestore(&rq->lock, flags);
+}
+
+/* the timeslice of a running process is its part of SCHED_LATENCY in
+ * proportion to its weight
+ */
+static uint64_t rq_timeslice(struct runqueue *rq, struct proc *curr)
+{
+	uint64_t ideal = SCHED_LATENCY * curr->weight / (rq->load + curr->weight);
+	return MAX(ideal, (uint64_t)SCHED_MIN_GRANULARITY);
+}
+
+/* Decide whether the running process has had its share on a tick
+ *
+ * A wakeup preemption request is honoured right away.
+ */
+static bool rq_tick_preempt(struct runqueue *rq, struct proc *curr, uint64_t now, bool resched)
+{
+	bool ret = false;
+
+	uint64_t flags = spinlock_acquire_irqsave(&rq->lock);
+
+	proc_update_vruntime(curr, now);
+
+	if (rq->leftmost != NULL) {
+		uint64_t ran = now - curr->slice_start;
+		uint64_t ideal = rq_timeslice(rq, curr);
+
+		if (resched || ran >= ideal)
+			ret = true;
+		else if (ran >= SCHED_MIN_GRANULARITY && curr->vruntime > rq->leftmost->key + ideal)
+			ret = true;
+	}
+
+	spinlock_release_irqrestore(&rq->lock, flags);
+
+	return ret;
+}
+
+void proc_set_nice(struct proc *proc, int nice)
+{
+	nice = MIN(MAX(nice, -20), 19);
+
+	uint64_t flags;
+	struct runqueue *rq = proc_rq_lock(proc, &flags);
+
+	if (proc->state == PROC_STOPPED)
+		rq->load -= proc->weight;
+
+	proc->nice = nice;
+	proc->weight = nice_to_weight[nice + 20];
+
+	if (proc->state == PROC_STOPPED)
+		rq->load += proc->weight;
+
+	spinlock_release_irqrestore(&rq->lock, flags);
+}
+
+bool proc_need_resched()
+{
+	return runqueues[cpu_id()].need_resched;
+}
+
+/* the context to save to or resume from: the kernel one during a system call */
+static inline struct procregs *proc_regs(struct proc *proc)
+{
+	return proc->in_kernel ? &proc->kregs : &proc->regs;
+}
+
+struct procregs *proc_current_regs()
+{
+	struct proc *proc = proc_current();
+
+	return proc ? proc_regs(proc) : NULL;
+}
+
 pid_t getpid()
 {
-	return proc_current[lapic_idno()];
+	struct proc *proc = proc_current();
+
+	return proc ? proc->pid : 0;
 }
 
+/* the user process a system call runs for, or 0 */
 pid_t getupid()
 {
-	struct proc *proc = proc_find(getpid());
+	struct proc *proc = proc_current();
 
-	if (proc && proc->buddy_proc)
-		return proc->buddy_proc->pid;
+	if (proc && !proc->is_kernel)
+		return proc->pid;
 	else
 		return 0;
 }
 
-void proc_set_state(pid_t pid, uint8_t state)
+/* the user a system call runs as, root for the kernel */
+uid_t getuid()
 {
-	struct proc *proc = proc_find(pid);
-	spinlock_acquire(&proc->lock);
-	proc->state = state;
-	spinlock_release(&proc->lock);
+	struct proc *proc = proc_current();
+
+	if (proc && !proc->is_kernel)
+		return proc->uid;
+	else
+		return 0;
 }
 
-struct proc *proc_find(pid_t pid)
+/* The first process of rq that no other CPU is still leaving, which would
+ * otherwise end up running on the same stack twice. prev is the process this
+ * CPU is switching away from, it can be picked again.
+ */
+static struct proc *rq_pick(struct runqueue *rq, struct proc *prev)
 {
-	if (pid == 0)
-		return &kernel_procs[lapic_idno()];
+	for (struct rbnode *node = rq->leftmost; node != NULL; node = rbt_successor(node)) {
+		struct proc *proc = rq_proc(node);
+		if (!proc->on_cpu || proc == prev)
+			return proc;
+	}
 
-	struct rbnode *proc_node = rbt_search(proc_tree, pid);
+	return NULL;
+}
 
-	if (proc_node)
-		return (void *)proc_node->value;
-	else
+/* Take a process from the longest run queue for an idle CPU
+ *
+ * Processes that ran recently are left where they are, they are cheaper to
+ * run on their own CPU once it gets to them, unless that queue is long enough
+ * to make waiting more expensive than a cold cache
+ */
+static struct proc *rq_steal(unsigned cpu, uint64_t now)
+{
+	struct runqueue *busiest = NULL;
+	size_t max_len = 0;
+
+	/* unlocked peek, the queue is checked again once locked */
+	for (unsigned i = 0; i < num_runqueues; i++) {
+		struct runqueue *rq = &runqueues[runqueue_cpus[i]];
+		if (runqueue_cpus[i] != cpu && rq->len > max_len) {
+			busiest = rq;
+			max_len = rq->len;
+		}
+	}
+
+	if (busiest == NULL)
 		return NULL;
+
+	struct proc *ret = NULL;
+
+	uint64_t flags = spinlock_acquire_irqsave(&busiest->lock);
+
+	for (struct rbnode *node = busiest->leftmost; node != NULL; node = rbt_successor(node)) {
+		struct proc *proc = rq_proc(node);
+		if (!proc->on_cpu && now - proc->last_run > SCHED_MIGRATION_COST) {
+			ret = proc;
+			break;
+		}
+	}
+
+	if (ret == NULL && busiest->len >= SCHED_IMBALANCE)
+		ret = rq_pick(busiest, NULL);
+
+	if (ret != NULL) {
+		rq_dequeue(busiest, ret);
+
+		/* keep its lag relative to the queue it joins */
+		int64_t lag = (int64_t)(ret->vruntime - busiest->min_vruntime);
+		int64_t vruntime = (int64_t)runqueues[cpu].min_vruntime + lag;
+		ret->vruntime = vruntime > 0 ? vruntime : 0;
+		ret->state = PROC_RUNNING;
+		ret->exec_start = now;
+		ret->slice_start = now;
+		ret->cpu = cpu;
+		ret->on_cpu = true;
+	}
+
+	spinlock_release_irqrestore(&busiest->lock, flags);
+
+	return ret;
 }
 
-struct proc *proc_next(struct proc *proc)
+void proc_set_state(pid_t pid, uint8_t state)
 {
-	struct rbnode *proc_node = rbt_search(proc_tree, proc->pid);
+	rcu_read_lock();
+	struct proc *proc = proc_find(pid);
+	proc_change_state(proc, state);
+	rcu_read_unlock();
+}
 
-	if (proc_node)
-		proc_node = rbt_successor(proc_node);
+/* Look up a process by PID. Call it under rcu_read_lock, the process is only
+ * guaranteed to stay around until the matching rcu_read_unlock.
+ */
+struct proc *proc_find(pid_t pid)
+{
+	if (pid == 0)
+		return &kernel_procs[cpu_id()];
 
-	if (proc_node) {
-		if (proc_node->key == 0)
-			goto kernel_proc;
+	struct proc *proc = rcu_dereference(*pid_hash_bucket(pid));
+	while (proc != NULL && proc->pid != pid)
+		proc = rcu_dereference(proc->pid_next);
 
-		return (void *)proc_node->value;
-	} else {
-kernel_proc:
-		return &kernel_procs[lapic_idno()];
-	}
+	return proc;
 }
 
-void proc_set_current(pid_t pid)
+/* NULL switches to the idle process of the CPU */
+void proc_set_current(struct proc *proc)
 {
-	proc_current[lapic_idno()] = pid;
+	struct percpu *cpu = this_cpu();
+	struct proc *next = proc ? proc : &kernel_procs[cpu->id];
+
+	fpu_switch(cpu->curr, next);
+
+	cpu->curr = next;
+	runqueues[cpu->id].curr = proc;
 }
 
 void proc_set_stack(struct proc *proc, uintptr_t base, size_t size)
@@ -120,6 +539,18 @@ void proc_set_exec_addr(struct proc *proc, uintptr_t addr)
 	proc->regs.rip = addr;
 }
 
+static void proc_free_rcu(struct rcu_head *head)
+{
+	struct proc *proc = (struct proc *)((uintptr_t)head - offsetof(struct proc, rcu));
+
+	if (proc->kstack)
+		buddy_free((void *)proc->kstack);
+
+	fpu_free(proc);
+
+	kmem_cache_free(proc_cache, proc);
+}
+
 void proc_term(pid_t pid)
 {
 	if (pid == 1) {
@@ -127,13 +558,17 @@ void proc_term(pid_t pid)
 		reboot();
 	}
 
-	struct rbnode *proc_node = rbt_search(proc_tree, pid);
+	/* nothing but proc_term frees a process, it stays valid past the lookup */
+	rcu_read_lock();
+	struct proc *proc = proc_find(pid);
+	rcu_read_unlock();
+
+	if (proc) {
+		proc_change_state(proc, PROC_ZOMBIE);
 
-	if (proc_node) {
-		struct proc *proc = (void *)proc_node->value;
 		spinlock_acquire(&proc->lock);
 
-		rbt_delete(proc_tree, proc_node);
+		pid_hash_remove(proc);
 
 		struct rbnode *node = rbt_minimum(proc->umalloc_tree.root);
 		while (node) {
@@ -149,38 +584,60 @@ void proc_term(pid_t pid)
 			node = next;
 		}
 
+		write_lock(&proc->fd_map_lock);
 		node = rbt_minimum(proc->fd_map.root);
 		while (node) {
 			struct rbnode *next = rbt_successor(node);
 			struct file_descriptor *fdesc = (void *)node->value;
 
-			spinlock_acquire(&fdesc->file->ref_lock);
-			fdesc->file->refcount--;
-			if (fdesc->file->refcount == 0)
+			if (atomic_dec_and_test(&fdesc->file->refcount))
 				vfs_close(fdesc->file);
-			spinlock_release(&fdesc->file->ref_lock);
-			slab_free(fd_slab, fdesc);
+			kmem_cache_free(fd_cache, fdesc);
 			node = next;
 		}
 
 		buddy_free((void *)((paddr_t)proc->cr3 | hhdm_start));
 		rbt_destroy(&proc->page_map);
 		rbt_destroy(&proc->fd_map);
+		write_unlock(&proc->fd_map_lock);
+
+		spinlock_release(&proc->lock);
 
-		slab_free(proc_slab, proc);
+		call_rcu(&proc->rcu, proc_free_rcu);
 	} else {
 		kprintf(LOG_ERROR "proc: proc_term: proc %d not found\n", pid);
 		panic();
 	}
 }
 
+/* the rest of proc_exit, on the stack of the CPU */
+static void proc_exit_finish(void *arg)
+{
+	proc_term((pid_t)(uintptr_t)arg);
+	schedule();
+}
+
+/* Terminate the current process and run something else
+ *
+ * Its page tables and kernel stack go away with it, so this CPU moves to the
+ * kernel ones before proc_term can free them.
+ */
+void proc_exit()
+{
+	uintptr_t kstack = this_cpu()->kstack;
+	pid_t pid = getpid();
+
+	cr3_write(kcr3);
+	proc_set_current(NULL);
+
+	load_stack_and_jump(kstack, kstack, proc_exit_finish, (void *)(uintptr_t)pid);
+}
+
 void proc_yield()
 {
-	struct proc *proc = proc_find(getpid());
-	proc_set_current(0);
-	spinlock_acquire(&proc->lock);
-	proc->state = PROC_STOPPED;
-	spinlock_release(&proc->lock);
+	struct proc *proc = proc_current();
+	proc_set_current(NULL);
+	proc_change_state(proc, PROC_STOPPED);
 	sti();
 	yield();
 }
@@ -191,49 +648,97 @@ void trap_sched()
 	schedule();
 }
 
-void schedule()
+/* program the next tick for the end of the timeslice of curr */
+static void rq_arm_tick(struct runqueue *rq, struct proc *curr, uint64_t now)
 {
-	uint8_t id = lapic_idno();
+	uint64_t ran = now - curr->slice_start;
+	uint64_t slice = rq_timeslice(rq, curr);
 
-	struct proc *proc = proc_find(proc_current[id]);
+	apic_timer_oneshot(ran < slice ? slice - ran : slice);
+}
 
-	if (proc && proc->state == PROC_RUNNING) {
-		spinlock_acquire(&proc->lock);
-		proc->state = PROC_STOPPED;
-		spinlock_release(&proc->lock);
+/* Idle loop, run on the kernel stack of the CPU
+ *
+ * The timer is stopped, the CPU sleeps until a device interrupt or a kick from
+ * another CPU that has work for it.
+ */
+static void sched_idle(volatile bool *prev_on_cpu)
+{
+	if (prev_on_cpu)
+		*prev_on_cpu = false;
+
+	apic_timer_stop();
+
+	while (1) {
+		kmsg_kick();
+		sti();
+		yield();
 	}
+}
 
-	size_t num_procs = proc_tree->num_nodes;
-	size_t counter = 0;
-	size_t limit = num_procs * 2;
-	while (counter < limit) {
-		/* next process */
-		proc = proc_next(proc);
+void schedule()
+{
+	struct percpu *cpu = this_cpu();
+	uint8_t id = cpu->id;
+	struct runqueue *rq = &runqueues[id];
+	uint64_t now = clock_ns();
+
+	rcu_note_qs();
+	tlb_note_reload();
+	kmsg_kick();
+
+	bool resched = rq->need_resched;
+	rq->need_resched = false;
+
+	struct proc *proc = cpu->curr;
+	struct proc *prev = proc;
+
+	if (proc && proc->pid != 0 && proc->state == PROC_RUNNING) {
+		/* keep running until the timeslice is used up */
+		if (!rq_tick_preempt(rq, proc, now, resched)) {
+			rq_arm_tick(rq, proc, now);
+			_return_to_user(proc_regs(proc), proc->cr3, NULL);
+		}
 
-		if (proc->pid == 0)
-			continue;
+		proc_change_state(proc, PROC_STOPPED);
+	}
 
-		spinlock_acquire(&proc->lock);
+	/* prev may already be queued or woken, but this CPU is on its stack until
+	 * _return_to_user or sched_idle, nobody else may pick it before that
+	 */
+	volatile bool *prev_on_cpu = NULL;
+	if (prev && prev->pid != 0)
+		prev_on_cpu = &prev->on_cpu;
+
+	uint64_t flags = spinlock_acquire_irqsave(&rq->lock);
+	proc = rq_pick(rq, prev);
+	if (proc) {
+		rq_dequeue(rq, proc);
+
+		rq->min_vruntime = MAX(rq->min_vruntime, proc->vruntime);
+		proc->state = PROC_RUNNING;
+		proc->exec_start = now;
+		proc->slice_start = now;
+		proc->on_cpu = true;
+	}
+	spinlock_release_irqrestore(&rq->lock, flags);
 
-		switch (proc->state) {
-		case PROC_STOPPED:
+	/* nothing to do here, look for work on the other CPUs */
+	if (proc == NULL)
+		proc = rq_steal(id, now);
 
-			proc->state = PROC_RUNNING;
-			proc_set_current(proc->pid);
-			spinlock_release(&proc->lock);
-			_return_to_user(&proc->regs, proc->cr3);
-			break;
-		case PROC_ZOMBIE:
-		case PROC_BLOCKED:
-		case PROC_RUNNING:
-			spinlock_release(&proc->lock);
-			break;
-		}
+	if (proc) {
+		proc_set_current(proc);
+		trace(TRACE_SCHED_SWITCH, prev ? prev->pid : 0, proc->pid);
+		rq_arm_tick(rq, proc, now);
+		_return_to_user(proc_regs(proc), proc->cr3, proc == prev ? NULL : prev_on_cpu);
 	}
 
-	/* no process to run */
-	sti();
-	yield();
+	/* no process to run, the stack of whatever called schedule is dropped */
+	proc_set_current(NULL);
+	cr3_write(kcr3);
+	trace(TRACE_SCHED_SWITCH, prev ? prev->pid : 0, 0);
+	load_stack_and_jump(cpu->kstack, cpu->kstack, sched_idle, (void *)prev_on_cpu);
 }
 
 void proc_init_page_tables(struct proc *proc)
@@ -245,13 +750,9 @@ void proc_init_page_tables(struct proc *proc)
 
 void proc_init_memory(struct proc *proc, uint64_t mem_flags)
 {
-	if (proc->is_kernel && proc->buddy_proc) {
-		proc->cr3 = proc->buddy_proc->cr3;
-	} else {
-		proc->cr3 = (uintptr_t)buddy_alloc(0x1000);
-		memcpy((void *)proc->cr3, (void *)(kcr3 | hhdm_start), 0x1000);
-		proc->cr3 &= ~(hhdm_start);
-	}
+	proc->cr3 = (uintptr_t)buddy_alloc(0x1000);
+	memcpy((void *)proc->cr3, (void *)(kcr3 | hhdm_start), 0x1000);
+	proc->cr3 &= ~(hhdm_start);
 
 	uintptr_t stackaddr = (uintptr_t)buddy_alloc(0x4000);
 	proc->stack_start = stackaddr;
@@ -271,28 +772,34 @@ void proc_init_memory(struct proc *proc, uint64_t mem_flags)
 
 struct proc *proc_createv(int flags)
 {
-	struct proc *proc = slab_alloc(proc_slab);
+	struct proc *proc = kmem_cache_alloc(proc_cache);
 	memset(proc, 0, sizeof(struct proc));
 
 	spinlock_acquire(&proc->lock);
 
 	if (flags & PT_KERN) {
-		kpid_counter++;
-		proc->pid = -kpid_counter;
+		proc->pid = -__atomic_add_fetch(&kpid_counter, 1, __ATOMIC_RELAXED);
 		proc->is_kernel = true;
 		proc->regs.cs = GDT_SEGMENT_CODE_RING0 | 0;
 		proc->regs.ss = GDT_SEGMENT_DATA_RING0 | 0;
 	} else {
-		pid_counter++;
-		proc->pid = pid_counter;
+		proc->pid = __atomic_add_fetch(&pid_counter, 1, __ATOMIC_RELAXED);
 		proc->is_kernel = false;
 		proc->regs.cs = GDT_SEGMENT_CODE_RING3 | 3;
 		proc->regs.ss = GDT_SEGMENT_DATA_RING3 | 3;
+
+		proc->kstack = (uintptr_t)buddy_alloc(KSTACK_SIZE);
+		proc->kregs.cs = GDT_SEGMENT_CODE_RING0 | 0;
+		proc->kregs.ss = GDT_SEGMENT_DATA_RING0 | 0;
 	}
 
 	proc->state = PROC_RUNNING; /* prevent immediate scheduling */
-	struct rbnode *proc_node = rbt_insert(proc_tree, proc->pid);
-	proc_node->value = (uintptr_t)proc;
+	proc->cpu = cpu_id();
+	proc->fpu_cpu = -1;
+	proc->nice = 0;
+	proc->weight = NICE_0_WEIGHT;
+	proc->vruntime = runqueues[proc->cpu].min_vruntime;
+	pid_hash_insert(proc);
 
 	spinlock_release(&proc->lock);
 
@@ -304,88 +811,74 @@ struct proc *proc_create()
 	return proc_createv(PT_USER);
 }
 
-struct proc *proc_get(pid_t pid)
+/* create a kernel thread running entry and make it schedulable right away */
+struct proc *proc_create_kthread(void (*entry)())
 {
-	struct rbnode *proc_node = rbt_search(proc_tree, pid);
+	struct proc *proc = proc_createv(PT_KERN);
+	proc_init_memory(proc, 0);
+	proc_set_flags(proc, 0x46);
+	proc_set_exec_addr(proc, (uintptr_t)entry);
+	proc_set_state(proc->pid, PROC_ALLOWSCHED);
 
-	if (proc_node)
-		return (void *)proc_node->value;
-	else
-		return NULL;
+	return proc;
 }
 
-void proc_enter_kernel(uint64_t save, void *ret)
+struct proc *proc_get(pid_t pid)
 {
-	struct proc *proc = proc_find(getpid());
-
-	if (proc->is_kernel) {
-		kprintf(LOG_ERROR "proc: proc_enter_kernel: process %d is already a kernel process\n", getpid());
-		panic();
-	}
+	return proc_find(pid);
+}
 
-	struct proc *kernel_proc;
-	if (proc->buddy_proc) {
-		kernel_proc = proc->buddy_proc;
-	} else {
-		kernel_proc = proc_createv(PT_KERN);
+/* Called on system call entry with the user context saved, returns the top of
+ * the kernel stack of the process to run the call on
+ */
+uintptr_t proc_enter_kernel()
+{
+	struct proc *proc = proc_current();
 
-		kernel_proc->is_kernel = true;
-		kernel_proc->buddy_proc = proc;
+	if (proc->is_kernel || proc->in_kernel) {
+		kprintf(LOG_ERROR "proc: proc_enter_kernel: process %d is already in the kernel\n", getpid());
+		panic();
 	}
 
-	proc_init_memory(kernel_proc, PAGE_PRESENT | PAGE_RW);
-
-	spinlock_acquire(&proc->lock);
-	proc->state = PROC_BLOCKED;
-	spinlock_release(&proc->lock);
+	proc->in_kernel = true;
 
-	proc->buddy_proc = kernel_proc;
-	kernel_proc->buddy_proc = proc;
-
-	/* move the save value into RAX */
-	kernel_proc->regs.rax = save;
-	proc_set_current(kernel_proc->pid);
-	load_stack_and_jump(kernel_proc->regs.rsp, kernel_proc->regs.rbp, ret, (void *)save);
+	return proc->kstack + KSTACK_SIZE;
 }
 
-uint64_t proc_leave_kernel(uint64_t ret, bool shouldret)
+/* called on system call exit, sets the return value in the user context */
+uint64_t proc_leave_kernel(uint64_t ret)
 {
-	struct proc *proc = proc_find(getpid());
-
-	if (!proc->is_kernel) {
-		kprintf(LOG_ERROR "proc: proc_leave_kernel: process %d is not a kernel process\n", getpid());
-		panic();
-	}
+	struct proc *proc = proc_current();
 
-	struct proc *uproc = proc->buddy_proc;
+	proc->in_kernel = false;
+	proc->regs.rax = ret;
 
-	if (shouldret) {
-		uproc->regs.rax = ret;
-	}
+	return ret;
+}
 
-	proc_set_current(uproc->pid);
+/* make the run queue of this CPU visible to the balancer */
+void proc_init_cpu()
+{
+	unsigned n = __atomic_fetch_add(&num_runqueues, 1, __ATOMIC_RELAXED);
+	runqueue_cpus[n] = cpu_id();
 
-	spinlock_acquire(&proc->lock);
-	proc->state = PROC_BLOCKED;
-	spinlock_release(&proc->lock);
+	proc_set_current(NULL);
 
-	spinlock_acquire(&uproc->lock);
-	uproc->state = PROC_RUNNING;
-	spinlock_release(&uproc->lock);
+	rcu_init_cpu();
+}
 
-	return ret;
+/* LAPIC IDs of the CPUs in the scheduler, returns how many there are */
+unsigned proc_cpus(const uint8_t **ids)
+{
+	*ids = runqueue_cpus;
+	return __atomic_load_n(&num_runqueues, __ATOMIC_ACQUIRE);
 }
 
 void proc_init(unsigned num_cpus)
 {
-	/* allocate current process structs */
-	proc_current = kzalloc(num_cpus * sizeof(pid_t), ALLOC_KERN);
-	proc_tree = kzalloc(sizeof(struct rbtree), ALLOC_KERN);
-	proc_slab = slab_create(sizeof(struct proc), 32 * KB, 0);
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc), 0, SLAB_HWCACHE_ALIGN, NULL);
 
 	for (unsigned i = 0; i < num_cpus; i++) {
-		proc_current[i] = -1;
-
 		struct proc *proc = &kernel_procs[i];
 
 		proc->pid = 0;
@@ -396,14 +889,7 @@ void proc_init(unsigned num_cpus)
 		proc->regs.cs = 0x28;
 		proc->regs.rflags = 0x246;
 		proc->regs.rsp = kstacks[i] + 0xFF0;
-
-		proc_current[i] = 0;
 	}
 
-	/* ensure that the first process has PID 0
-	 * this value is never actually used, it prevents other processes from
-	 * having PID 0
-	 */
-	proc_set_current(0);
-	(void)rbt_insert(proc_tree, 0);
+	proc_set_current(NULL);
 }
@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <kernel/common.h>
+#include <kernel/lock.h>
+#include <kernel/proc.h>
+#include <kernel/rcu.h>
+#include <kernel/percpu.h>
+#include <kernel/slab.h>
+#include <kernel/wait.h>
+
+/* Per-CPU state. Read sections disable interrupts, so a reader can't be
+ * switched away from its CPU and a CPU that goes through schedule or is seen
+ * with no read section open has no reader left from before.
+ */
+static volatile uint32_t rcu_nesting[256] = { 0 };
+static volatile uint64_t rcu_qs_seq[256] = { 0 };
+static uint64_t rcu_saved_flags[256];
+
+static uint8_t rcu_cpus[256];
+static unsigned rcu_num_cpus = 0;
+
+/* callbacks waiting for a grace period, run by krcud */
+static struct rcu_head *rcu_pending = NULL;
+static spinlock_t rcu_pending_lock = 0;
+static waitq_t rcu_wq;
+
+void rcu_read_lock()
+{
+	uint64_t flags = irq_save();
+	uint8_t cpu = cpu_id();
+
+	/* a locked add orders the count before the reads of the section */
+	if (__atomic_fetch_add(&rcu_nesting[cpu], 1, __ATOMIC_SEQ_CST) == 0)
+		rcu_saved_flags[cpu] = flags;
+}
+
+void rcu_read_unlock()
+{
+	uint8_t cpu = cpu_id();
+
+	if (__atomic_sub_fetch(&rcu_nesting[cpu], 1, __ATOMIC_RELEASE) == 0)
+		irq_restore(rcu_saved_flags[cpu]);
+}
+
+/* called on every pass through the scheduler */
+void rcu_note_qs()
+{
+	__atomic_add_fetch(&rcu_qs_seq[cpu_id()], 1, __ATOMIC_RELEASE);
+}
+
+/* wait until every reader that could see the old version has finished */
+void synchronize_rcu()
+{
+	uint8_t self = cpu_id();
+	bool can_sleep = getpid() != 0;
+
+	/* order the caller's unpublishing before the reads of the reader state */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (unsigned i = 0; i < rcu_num_cpus; i++) {
+		uint8_t cpu = rcu_cpus[i];
+		if (cpu == self)
+			continue;
+
+		uint64_t seq = __atomic_load_n(&rcu_qs_seq[cpu], __ATOMIC_ACQUIRE);
+
+		while (__atomic_load_n(&rcu_nesting[cpu], __ATOMIC_ACQUIRE) != 0 &&
+		       __atomic_load_n(&rcu_qs_seq[cpu], __ATOMIC_ACQUIRE) == seq) {
+			if (can_sleep)
+				sswtch();
+			else
+				cpu_relax();
+		}
+	}
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+	head->func = func;
+
+	spinlock_acquire(&rcu_pending_lock);
+	head->next = rcu_pending;
+	rcu_pending = head;
+	spinlock_release(&rcu_pending_lock);
+
+	waitq_wake_one(&rcu_wq);
+}
+
+struct rcu_kfree {
+	struct rcu_head head;
+	void *ptr;
+};
+
+static void rcu_kfree_cb(struct rcu_head *head)
+{
+	struct rcu_kfree *k = (struct rcu_kfree *)head;
+	kfree(k->ptr);
+	kfree(k);
+}
+
+/* kfree ptr once the readers that may still see it are done */
+void kfree_rcu(void *ptr)
+{
+	struct rcu_kfree *k = kmalloc(sizeof(struct rcu_kfree), ALLOC_KERN);
+	if (k == NULL) {
+		synchronize_rcu();
+		kfree(ptr);
+		return;
+	}
+
+	k->ptr = ptr;
+	call_rcu(&k->head, rcu_kfree_cb);
+}
+
+static void krcud()
+{
+	sti();
+
+	while (1) {
+		wait_event(&rcu_wq, rcu_pending != NULL);
+
+		spinlock_acquire(&rcu_pending_lock);
+		struct rcu_head *head = rcu_pending;
+		rcu_pending = NULL;
+		spinlock_release(&rcu_pending_lock);
+
+		synchronize_rcu();
+
+		while (head != NULL) {
+			struct rcu_head *next = head->next;
+			head->func(head);
+			head = next;
+		}
+	}
+}
+
+void rcu_init_cpu()
+{
+	unsigned n = __atomic_fetch_add(&rcu_num_cpus, 1, __ATOMIC_RELAXED);
+	rcu_cpus[n] = cpu_id();
+}
+
+void rcu_init()
+{
+	waitq_init(&rcu_wq);
+	proc_create_kthread(krcud);
+}
@@ -2,20 +2,24 @@
 #include <kernel/lock.h>
 #include <kernel/common.h>
 #include <kernel/proc.h>
+#include <kernel/rcu.h>
 #include <kernel/slab.h>
 #include <kernel/rbtree.h>
 #include <kernel/syscall.h>
 #include <kernel/msr.h>
 #include <kernel/gdt.h>
+#include <kernel/fpu.h>
+#include <kernel/trace.h>
 
 #include <fs/vfs.h>
+#include <fs/pipe.h>
 
 #define SYSCALL_MAX 0x100
 
 typedef uint64_t (*syscall_t)(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5);
 
 syscall_t syscall_table[SYSCALL_MAX];
-slab_t *fd_slab;
+struct kmem_cache *fd_cache;
 
 void gate_syscall();
 
@@ -26,11 +30,13 @@ uint64_t syscall(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uin
 	if (sc_sel == NULL)
 		return -ENOSYS;
 
-	struct proc *proc = proc_find(getpid());
+	struct proc *proc = proc_current();
 	if (proc == NULL)
 		return -1;
 
+	trace(TRACE_SYSCALL_ENTER, syscall_no, arg1);
 	uint64_t ret = sc_sel(arg1, arg2, arg3, arg4, arg5);
+	trace(TRACE_SYSCALL_EXIT, syscall_no, ret);
 
 	return ret;
 }
@@ -43,21 +49,28 @@ void sys_set_return(struct proc *proc, uint64_t ret)
 	proc->regs.rax = ret;
 }
 
+static struct file_descriptor *fd_get(struct proc *proc, int fd)
+{
+	read_lock(&proc->fd_map_lock);
+	struct rbnode *node = rbt_search(&proc->fd_map, fd);
+	read_unlock(&proc->fd_map_lock);
+
+	return node ? (void *)node->value : NULL;
+}
+
 ssize_t sys_read(int fd, void *buf, size_t count)
 {
 	if ((uintptr_t)buf >= hhdm_start)
 		return -EFAULT;
 
-	struct proc *proc = proc_find(getupid());
+	struct proc *proc = proc_current();
 	if (proc == NULL)
 		return -1;
 
-	struct rbnode *fdesc_node = rbt_search(&proc->fd_map, fd);
-
-	if (fdesc_node == NULL)
+	struct file_descriptor *fdesc = fd_get(proc, fd);
+	if (fdesc == NULL)
 		return -EBADF;
 
-	struct file_descriptor *fdesc = (void *)fdesc_node->value;
 	struct file *file = fdesc->file;
 	void *tmp_buf = kzalloc(count, ALLOC_KERN);
 	if (tmp_buf == NULL)
@@ -65,9 +78,10 @@ ssize_t sys_read(int fd, void *buf, size_t count)
 
 	ssize_t ret = vfs_read(file, tmp_buf, fdesc->pos, count);
 
+	/* 0 is the end of the file */
 	if (ret > 0)
-		memcpy(buf, tmp_buf, count);
-	else
+		memcpy(buf, tmp_buf, ret);
+	else if (ret < 0)
 		ret = -1;
 
 	fdesc->pos += ret;
@@ -81,16 +95,14 @@ ssize_t sys_write(int fd, void *buf, size_t count)
 	if ((uintptr_t)buf >= hhdm_start)
 		return -EFAULT;
 
-	struct proc *proc = proc_find(getupid());
+	struct proc *proc = proc_current();
 	if (proc == NULL)
 		return -1;
 
-	struct rbnode *fdesc_node = rbt_search(&proc->fd_map, fd);
-
-	if (fdesc_node == NULL)
+	struct file_descriptor *fdesc = fd_get(proc, fd);
+	if (fdesc == NULL)
 		return -EBADF;
 
-	struct file_descriptor *fdesc = (void *)fdesc_node->value;
 	struct file *file = fdesc->file;
 
 	void *tmp_buf = kzalloc(count, ALLOC_KERN);
@@ -106,12 +118,36 @@ ssize_t sys_write(int fd, void *buf, size_t count)
 	return ret;
 }
 
+/* give file a free descriptor of proc, which takes a reference */
+static int fd_install(struct proc *proc, struct file *file, int flags)
+{
+	struct file_descriptor *fdesc = kmem_cache_alloc(fd_cache);
+	if (fdesc == NULL)
+		return -ENOMEM;
+
+	write_lock(&proc->fd_map_lock);
+	uint64_t fdno = rbt_next_key(&proc->fd_map);
+
+	fdesc->fd = fdno;
+	fdesc->file = file;
+	fdesc->pos = 0;
+	fdesc->flags = flags;
+
+	atomic_inc(&file->refcount);
+
+	struct rbnode *node = rbt_insert(&proc->fd_map, fdno);
+	node->value = (uintptr_t)fdesc;
+	write_unlock(&proc->fd_map_lock);
+
+	return fdno;
+}
+
 int sys_open(const char *pathname, int flags)
 {
 	if ((uintptr_t)pathname >= hhdm_start)
 		return -EFAULT;
 
-	struct proc *proc = proc_find(getupid());
+	struct proc *proc = proc_current();
 	if (proc == NULL)
 		return -1;
 
@@ -120,59 +156,106 @@ int sys_open(const char *pathname, int flags)
 	if (file == NULL)
 		return err;
 
-	struct file_descriptor *fdesc = slab_alloc(fd_slab);
-	uint64_t fdno = rbt_next_key(&proc->fd_map);
+	file->flags = flags;
+	if (file->type == VFS_VNO_FIFO)
+		pipe_open(file->vnode->priv_data, flags);
 
-	fdesc->fd = fdno;
-	fdesc->file = file;
-	fdesc->pos = 0;
-	fdesc->flags = flags;
+	int fd = fd_install(proc, file, flags);
+	if (fd < 0)
+		vfs_close(file);
 
-	spinlock_acquire(&file->ref_lock);
-	file->refcount++;
-	spinlock_release(&file->ref_lock);
+	return fd;
+}
 
-	struct rbnode *node = rbt_insert(&proc->fd_map, fdno);
-	node->value = (uintptr_t)fdesc;
+int sys_close(int fd)
+{
+	struct proc *proc = proc_current();
+	if (proc == NULL)
+		return -1;
 
-	return fdno;
+	write_lock(&proc->fd_map_lock);
+	struct rbnode *node = rbt_search(&proc->fd_map, fd);
+	if (node == NULL) {
+		write_unlock(&proc->fd_map_lock);
+		return -EBADF;
+	}
+
+	struct file_descriptor *fdesc = (void *)node->value;
+	rbt_delete(&proc->fd_map, node);
+	write_unlock(&proc->fd_map_lock);
+
+	if (atomic_dec_and_test(&fdesc->file->refcount))
+		vfs_close(fdesc->file);
+	kmem_cache_free(fd_cache, fdesc);
+
+	return 0;
 }
 
-void sys_exit(int status)
+/* fds[0] is the end for reading, fds[1] the end for writing */
+int sys_pipe(int fds[2])
 {
-	pid_t pid = getupid();
-	struct proc *proc = proc_find(pid);
+	if ((uintptr_t)fds >= hhdm_start)
+		return -EFAULT;
+
+	struct proc *proc = proc_current();
 	if (proc == NULL)
-		return;
+		return -1;
+
+	struct file *files[2];
+	int err = vfs_pipe(files);
+	if (err < 0)
+		return err;
+
+	int rfd = fd_install(proc, files[0], O_RDONLY);
+	int wfd = rfd < 0 ? rfd : fd_install(proc, files[1], O_WRONLY);
+
+	if (wfd < 0) {
+		if (rfd >= 0)
+			sys_close(rfd);
+		else
+			vfs_close(files[0]);
+		vfs_close(files[1]);
+		return wfd;
+	}
+
+	fds[0] = rfd;
+	fds[1] = wfd;
+
+	return 0;
+}
 
-	proc_term(pid);
+void sys_exit(int status)
+{
+	if (getupid() == 0)
+		return;
 
-	proc_set_current(0);
-	schedule();
+	proc_exit();
 }
 
 pid_t sys_fork()
 {
-	struct proc *parent = proc_find(getupid());
+	struct proc *parent = proc_current();
 	struct proc *proc = proc_create();
 
 	proc_clone_mmap(parent, proc);
+	fpu_fork(parent, proc);
 
 	/* copy file descriptors */
+	read_lock(&parent->fd_map_lock);
+	write_lock(&proc->fd_map_lock);
+
 	struct rbnode *node = rbt_minimum(parent->fd_map.root);
 	while (node) {
 		struct file_descriptor *fdesc = (void *)node->value;
 		struct file *file = fdesc->file;
 
-		struct file_descriptor *new_fdesc = slab_alloc(fd_slab);
+		struct file_descriptor *new_fdesc = kmem_cache_alloc(fd_cache);
 		new_fdesc->fd = fdesc->fd;
 		new_fdesc->file = file;
 		new_fdesc->pos = fdesc->pos;
 		new_fdesc->flags = fdesc->flags;
 
-		spinlock_acquire(&file->ref_lock);
-		file->refcount++;
-		spinlock_release(&file->ref_lock);
+		atomic_inc(&file->refcount);
 
 		struct rbnode *new_node = rbt_insert(&proc->fd_map, fdesc->fd);
 		new_node->value = (uintptr_t)new_fdesc;
@@ -180,28 +263,31 @@ pid_t sys_fork()
 		node = rbt_successor(node);
 	}
 
+	write_unlock(&proc->fd_map_lock);
+	read_unlock(&parent->fd_map_lock);
+
 	/* copy parent */
 	proc->parent = parent;
+	proc->uid = parent->uid;
 	proc->regs = parent->regs;
 	sys_set_return(proc, 0);
+	proc_set_nice(proc, parent->nice);
 
-	proc->state = PROC_STOPPED;
+	proc_set_state(proc->pid, PROC_STOPPED);
 
 	return proc->pid;
 }
 
 int sys_lsdir(int dirfd, struct dirent *dirents, size_t buf_size)
 {
-	struct proc *proc = proc_find(getupid());
+	struct proc *proc = proc_current();
 	if (proc == NULL)
 		return -1;
 
-	struct rbnode *fdesc_node = rbt_search(&proc->fd_map, dirfd);
-
-	if (fdesc_node == NULL)
+	struct file_descriptor *fdesc = fd_get(proc, dirfd);
+	if (fdesc == NULL)
 		return -EBADF;
 
-	struct file_descriptor *fdesc = (void *)fdesc_node->value;
 	struct file *file = fdesc->file;
 	struct vnode *vnode = file->vnode;
 
@@ -211,17 +297,22 @@ int sys_lsdir(int dirfd, struct dirent *dirents, size_t buf_size)
 	if ((vnode->flags & VFS_VTYPE_MASK) != VFS_VNO_DIR)
 		return -ENOTDIR;
 
-	size_t num_dirents = vnode->num_dirents;
+	rcu_read_lock();
+
+	size_t num_dirents = __atomic_load_n(&vnode->num_dirents, __ATOMIC_ACQUIRE);
+	struct dirent *vdirents = rcu_dereference(vnode->dirents);
 	int ret = MIN(num_dirents, buf_size / sizeof(struct dirent));
 
 	for(int i = 0; i < ret; i++) {
-		struct dirent *dirent = &vnode->dirents[i];
+		struct dirent *dirent = &vdirents[i];
 		memcpy(&dirents[i], dirent, sizeof(struct dirent));
 
 		/* don't leak kernel pointers */
 		dirents[i].vnode = NULL;
 	}
 
+	rcu_read_unlock();
+
 	return ret;
 }
 
@@ -274,7 +365,7 @@ void *sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset
 	if (!(flags & MAP_ANONYMOUS))
 		return (void *)-ENOSYS;
 
-	struct proc *proc = proc_find(getupid());
+	struct proc *proc = proc_current();
 	if (proc == NULL)
 		return (void *)-1;
 
@@ -288,7 +379,7 @@ void *sys_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset
 
 void *sys_munmap(void *addr, size_t len)
 {
-	struct proc *proc = proc_find(getupid());
+	struct proc *proc = proc_current();
 	if (proc == NULL)
 		return (void *)-1;
 
@@ -297,6 +388,50 @@ void *sys_munmap(void *addr, size_t len)
 	return 0;
 }
 
+/* which == PRIO_PROCESS only, who == 0 is the caller
+ *
+ * Like the Linux system call, the result is 20 - nice so that it is never
+ * negative and can't be mistaken for an error
+ */
+int sys_getpriority(int which, int who)
+{
+	if (which != PRIO_PROCESS || who < 0)
+		return -EINVAL;
+
+	rcu_read_lock();
+
+	struct proc *proc = proc_find(who ? who : getupid());
+	int ret = proc ? 20 - proc->nice : -ESRCH;
+
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/* only root may raise a priority or touch the processes of another user */
+int sys_setpriority(int which, int who, int nice)
+{
+	if (which != PRIO_PROCESS || who < 0)
+		return -EINVAL;
+
+	uid_t uid = getuid();
+	int ret = 0;
+
+	rcu_read_lock();
+
+	struct proc *proc = proc_find(who ? who : getupid());
+	if (proc == NULL)
+		ret = -ESRCH;
+	else if (uid != 0 && (proc->uid != uid || nice < proc->nice))
+		ret = -EPERM;
+	else
+		proc_set_nice(proc, nice);
+
+	rcu_read_unlock();
+
+	return ret;
+}
+
 static void syscall_insert(uint64_t syscall_no, syscall_t syscall)
 {
 	syscall_table[syscall_no] = syscall;
@@ -304,12 +439,14 @@ static void syscall_insert(uint64_t syscall_no, syscall_t syscall)
 
 void syscall_init()
 {
-	fd_slab = slab_create(sizeof(struct file_descriptor), 16 * KB, 0);
+	fd_cache = kmem_cache_create("file_descriptor", sizeof(struct file_descriptor), 0, 0, NULL);
 
 	memset(syscall_table, 0, sizeof(syscall_table));
 	syscall_insert(SYS_READ, (syscall_t)sys_read);
 	syscall_insert(SYS_WRITE, (syscall_t)sys_write);
 	syscall_insert(SYS_OPEN, (syscall_t)sys_open);
+	syscall_insert(SYS_CLOSE, (syscall_t)sys_close);
+	syscall_insert(SYS_PIPE, (syscall_t)sys_pipe);
 	syscall_insert(SYS_FORK, (syscall_t)sys_fork);
 	syscall_insert(SYS_EXIT, (syscall_t)sys_exit);
 	syscall_insert(SYS_LSDIR, (syscall_t)sys_lsdir);
@@ -317,7 +454,15 @@ void syscall_init()
 	syscall_insert(SYS_MUNMAP, (syscall_t)sys_munmap);
 	syscall_insert(SYS_MKDIR, (syscall_t)sys_mkdir);
 	syscall_insert(SYS_MKNOD, (syscall_t)sys_mknod);
+	syscall_insert(SYS_GETPRIORITY, (syscall_t)sys_getpriority);
+	syscall_insert(SYS_SETPRIORITY, (syscall_t)sys_setpriority);
 
+	syscall_init_cpu();
+}
+
+/* the syscall MSRs are per-CPU, every processor that runs processes sets them */
+void syscall_init_cpu()
+{
 	/* init syscall instruction */
 	uint64_t star = rdmsr(MSR_IA32_STAR);
 	star |= ((uint64_t)GDT_SEGMENT_CODE_RING0 << 32);
@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+#include <kernel/common.h>
+#include <kernel/proc.h>
+#include <kernel/wait.h>
+
+void sswtch_sleep(volatile bool *woken);
+
+/* wait queue locks disable interrupts, handlers wake waiters */
+void waitq_init(waitq_t *wq)
+{
+	wq->lock = 0;
+	wq->head = NULL;
+	wq->tail = NULL;
+}
+
+/* queue the current process on wq, it is woken by the next wakeup from now on */
+void waitq_prepare(waitq_t *wq, struct waitq_entry *entry)
+{
+	uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+
+	entry->proc = proc_current();
+	entry->woken = false;
+
+	if (!entry->queued) {
+		entry->queued = true;
+		entry->next = NULL;
+
+		if (wq->tail)
+			wq->tail->next = entry;
+		else
+			wq->head = entry;
+		wq->tail = entry;
+	}
+
+	spinlock_release_irqrestore(&wq->lock, flags);
+}
+
+void waitq_finish(waitq_t *wq, struct waitq_entry *entry)
+{
+	uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+
+	if (entry->queued) {
+		struct waitq_entry **prev = &wq->head;
+		struct waitq_entry *last = NULL;
+
+		while (*prev != entry) {
+			last = *prev;
+			prev = &(*prev)->next;
+		}
+
+		*prev = entry->next;
+		if (wq->tail == entry)
+			wq->tail = last;
+
+		entry->queued = false;
+	}
+
+	spinlock_release_irqrestore(&wq->lock, flags);
+}
+
+/* block until woken, returns right away if that already happened */
+void waitq_sleep(struct waitq_entry *entry)
+{
+	if (entry->proc->pid == 0 || entry->woken)
+		return;
+
+	sswtch_sleep(&entry->woken);
+}
+
+/* Called with wq locked. The waiter can't leave waitq_finish until the lock is
+ * released, so its entry and process stay valid until it has been woken.
+ */
+static void waitq_wake_entry(waitq_t *wq)
+{
+	struct waitq_entry *entry = wq->head;
+
+	wq->head = entry->next;
+	if (wq->head == NULL)
+		wq->tail = NULL;
+
+	entry->queued = false;
+	entry->woken = true;
+	proc_wake(entry->proc);
+}
+
+void waitq_wake_one(waitq_t *wq)
+{
+	uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+
+	if (wq->head)
+		waitq_wake_entry(wq);
+
+	spinlock_release_irqrestore(&wq->lock, flags);
+}
+
+void waitq_wake_all(waitq_t *wq)
+{
+	uint64_t flags = spinlock_acquire_irqsave(&wq->lock);
+
+	while (wq->head)
+		waitq_wake_entry(wq);
+
+	spinlock_release_irqrestore(&wq->lock, flags);
+}